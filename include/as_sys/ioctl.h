@@ -10,37 +10,335 @@
 
 /* Create a shared memory ring with the kernel to be able to submit async requests */
 #define AS_SYS_SETUP     _IOWR(AS_SYS_MAGIC, 1, void*)
-/* Block in the kernel for a set number of events or a timeout. */
+/*
+ * Block in the kernel for a set number of events or a timeout. Returns the
+ * number of events reaped.
+ */
 #define AS_SYS_GETEVENTS _IOR(AS_SYS_MAGIC,   2, void*)
 /* Destroy the async ring manually */
 #define AS_SYS_DESTROY   _IOW(AS_SYS_MAGIC,  3, unsigned int)
+/* Let the kernel know new submissions were pushed onto a context's ring. */
+#define AS_SYS_NOTIFY    _IOW(AS_SYS_MAGIC,  4, unsigned int)
+/*
+ * Pin a context's buffers or take its files once, for the AS_SYS_*_FIXED
+ * calls to refer to by index. See struct _async_register.
+ */
+#define AS_SYS_REGISTER_BUFFERS _IOW(AS_SYS_MAGIC, 5, void*)
+#define AS_SYS_REGISTER_FILES   _IOW(AS_SYS_MAGIC, 6, void*)
+/* Have completions on a context signal an eventfd, see struct _async_eventfd. */
+#define AS_SYS_REGISTER_EVENTFD _IOW(AS_SYS_MAGIC, 7, void*)
+/* Read a context's counters, see struct _async_stats. */
+#define AS_SYS_STATS _IOWR(AS_SYS_MAGIC, 8, void*)
+/* Cancel a submitted call by its user_data, see struct _async_cancel. */
+#define AS_SYS_CANCEL _IOW(AS_SYS_MAGIC, 9, void*)
+/* Push cbs without mapping the rings, and maybe wait, see struct _async_submit. */
+#define AS_SYS_SUBMIT _IOWR(AS_SYS_MAGIC, 10, void*)
 
+/* Linux syscalls take at most six arguments. */
+#define AS_SYS_MAX_ARGS 6
+
+/*
+ * Pseudo syscall numbers for an async_cb to read or write a registered file
+ * from or into a registered buffer, without looking the fd up or faulting the
+ * buffer in. Their args are:
+ *
+ *	file index, buffer index, offset into the buffer, length, file position
+ *
+ * A file position of -1 uses and advances the file's own, as read(2) does.
+ */
+#define AS_SYS_READ_FIXED  (-1)
+#define AS_SYS_WRITE_FIXED (-2)
+
+/*
+ * Flags of struct async_cb.
+ *
+ * AS_SYS_CB_LINK chains the cb after it in the ring to this one: once this
+ * one has completed the same worker runs the next right away, without going
+ * back to the process, and so on down the chain. A chain has to be pushed in
+ * one go onto a single ring (try_push_run() does) so that no other
+ * producer's cbs land in between, workers only take it once all of it is in.
+ * When a step fails (a negative result) every cb after it completes with
+ * -ECANCELED instead of being run. Completions of a chain are posted in
+ * order. Chains are cut after AS_SYS_MAX_LINKS cbs (or the size of the ring),
+ * what follows is a chain of its own.
+ */
+#define AS_SYS_CB_LINK (1U << 0)
+/*
+ * Interrupt the call if it is still running cb_timeout_ms after it started,
+ * it then completes with -ETIME (unless it succeeded anyway).
+ */
+#define AS_SYS_CB_TIMEOUT (1U << 1)
+/*
+ * Set by AS_SYS_CANCEL in a cb still on the ring, it completes with
+ * -ECANCELED without being run. The process may set it just as well.
+ */
+#define AS_SYS_CB_CANCELED (1U << 2)
+/*
+ * Let AS_SYS_SUBMIT run the call itself, right away, when it needn't wait on
+ * anything: the calls reading the user and group ids, and read(2)/pread64(2)
+ * of a range which is all in the page cache (as with RWF_NOWAIT). Anything
+ * else, a call which would have waited, or a read of a file which comes up
+ * short, goes to the workers as usual and returns what they would have. Not
+ * even getpid(2) and the like are run here, a worker answers them with its
+ * own ids. Copying to a user buffer which isn't resident can still fault and
+ * block the submitter. Ignored in chains and for cbs pushed onto the ring
+ * directly.
+ */
+#define AS_SYS_CB_INLINE (1U << 3)
+
+#define AS_SYS_MAX_LINKS 256
+
+/*
+ * A submission, copied into the submission ring where each takes exactly one
+ * cache line. The process may reuse its own copy as soon as it is pushed.
+ */
 struct async_cb {
-	long number; /* The syscall number. */
-	void * vargs[]; /* NULL terminated list of arguments to the syscall of given number. */
-};
+	__s32 number; /* The syscall number, or one of AS_SYS_*_FIXED. */
+	__u32 flags; /* AS_SYS_CB_* */
+	__u64 args[AS_SYS_MAX_ARGS]; /* All are passed, the syscall ignores what it doesn't take. */
+	__u64 user_data; /* Handed back in the async_event, untouched. */
+} __attribute__((aligned(64)));
 
-/* Used to store information about results. */
+/* A completion, four to a cache line of the completion ring. */
 struct async_event {
-	struct async_cb* cbp; /* Pointer to the async_cb where event came from. */
+	__u64 user_data; /* Of the async_cb the event came from. */
 	__s64 res; /* Result of syscall. */
-	// TODO: Might want other info like status code.
 };
 
+/*
+ * Opaque, and never the same for two contexts of a file in a row: a stale id
+ * of a destroyed context fails with EINVAL instead of finding a newer one.
+ */
 typedef __u64 async_context_t;
 
+/* Flags for struct _async_setup */
+/*
+ * Have a kernel thread poll the submission ring so that submitting does not
+ * need a syscall, see AS_SYS_SQ_NEED_WAKEUP. The poller takes a cpu while it
+ * spins, so the setup fails with EPERM without CAP_SYS_NICE.
+ */
+#define AS_SYS_SETUP_SQPOLL (1U << 0)
+/*
+ * Have push() and pop() on the context's rings spin for as long as it takes
+ * instead of eventually sleeping, for latency critical contexts.
+ */
+#define AS_SYS_SETUP_RING_SPIN (1U << 1)
+/*
+ * Give the context nr_sq_rings submission rings (one per online cpu if 0)
+ * instead of a single one. Any thread may push to any of them, picking the one
+ * of the cpu it runs on keeps submitters from contending with each other.
+ * Workers drain the ring of their own cpu first. Completions of all of them
+ * still land on the one completion ring.
+ */
+#define AS_SYS_SETUP_SQ_PER_CPU (1U << 2)
+
+#define AS_SYS_MAX_SQ_RINGS 64
+
+/*
+ * Place the context's rings and its workers on numa_node. Without it they
+ * follow the submitter: the node of the cpu calling AS_SYS_SETUP.
+ */
+#define AS_SYS_SETUP_NUMA_NODE (1U << 3)
+/*
+ * Only run the syscalls listed in syscalls, any other completes with -EPERM
+ * without being run. Numbers the module doesn't run at all (exit, fork,
+ * setuid, chdir, getpid, ...) fail the setup. The AS_SYS_*_FIXED calls are always allowed.
+ */
+#define AS_SYS_SETUP_ALLOWLIST (1U << 4)
+
+#define AS_SYS_MAX_ALLOWLIST 1024
+
+/*
+ * With cq_coalesce_nr set, only wake the process up (GETEVENTS, poll(2) and
+ * the eventfd) once cq_coalesce_nr events were posted or cq_coalesce_usecs
+ * after the first of them, whichever comes first. This flag makes the wait
+ * shrink with the calls still in flight, or skip it if there are none, so a
+ * lightly loaded context isn't held back waiting for events that won't come.
+ */
+#define AS_SYS_SETUP_CQ_ADAPTIVE (1U << 5)
+
+#define AS_SYS_MAX_CQ_COALESCE_USECS 1000000
+
 struct _async_setup {
 	unsigned long nr_events;
 	async_context_t *ctx_idp;
+	unsigned int flags;
+	/* With AS_SYS_SETUP_SQPOLL, the cpu to pin the poller to or -1. */
+	int sq_thread_cpu;
+	/*
+	 * With AS_SYS_SETUP_SQPOLL, milliseconds the poller will spin on an
+	 * empty ring before going to sleep. If 0 a default of one second.
+	 */
+	unsigned int sq_thread_idle;
+	/*
+	 * With AS_SYS_SETUP_SQ_PER_CPU, the number of submission rings. Set to
+	 * the number made by the kernel, 1 without the flag.
+	 */
+	unsigned int nr_sq_rings;
+	/*
+	 * With AS_SYS_SETUP_NUMA_NODE, the online node to place the context
+	 * on. Set to the node picked by the kernel either way.
+	 */
+	int numa_node;
+	/* Filled in by the kernel, the length to mmap(2) each ring with. */
+	unsigned long sq_ring_bytes;
+	unsigned long cq_ring_bytes;
+	/* With AS_SYS_SETUP_ALLOWLIST, the syscall numbers to allow. */
+	const __s32 *syscalls;
+	unsigned int nr_syscalls;
+	/* How long AS_SYS_CB_TIMEOUT calls may run, 0 to ignore the flag. */
+	unsigned int cb_timeout_ms;
+	/*
+	 * The context's share of the workers against the other contexts on
+	 * its node, up to AS_SYS_MAX_WEIGHT. 0 is the default of 1.
+	 */
+	unsigned int weight;
+	/* Most workers to run the context's calls at once, 0 for no limit. */
+	unsigned int max_workers;
+	/*
+	 * Completions to coalesce into one wakeup, 0 or 1 to wake on each.
+	 * Needs cq_coalesce_usecs, up to AS_SYS_MAX_CQ_COALESCE_USECS.
+	 */
+	unsigned int cq_coalesce_nr;
+	unsigned int cq_coalesce_usecs;
 };
 
+#define AS_SYS_MAX_WEIGHT 1024
+
+/*
+ * The rings of a context are shared with the process by mmap(2)ing the device
+ * file at the page offset picking the context and ring, e.g.
+ *
+ *	mmap(NULL, setup.sq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+ *	     AS_SYS_MMAP_PGOFF(ctx_id, AS_SYS_RING_SQ) * page_size);
+ *
+ * Each ring starts with its circle_buffer header.
+ */
+#define AS_SYS_RING_SQ 0 /* Submission ring of struct async_cb. */
+#define AS_SYS_RING_CQ 1 /* Completion ring of struct async_event. */
+/* With AS_SYS_SETUP_SQ_PER_CPU, the n-th submission ring (n < nr_sq_rings). */
+#define AS_SYS_RING_SQN(n) ((n) ? (n) + 1 : AS_SYS_RING_SQ)
+/*
+ * Set in the flags of the submission ring's header once its poller has gone
+ * to sleep. After pushing, a submitter seeing it needs to AS_SYS_NOTIFY. With
+ * several submission rings only the first one's flags are used.
+ */
+#define AS_SYS_SQ_NEED_WAKEUP (1U << 0)
+/*
+ * Set in the flags of the first submission ring's header while no worker is
+ * going to look at the rings again on its own. Without a poller, a submitter
+ * only needs to AS_SYS_NOTIFY when it sees it. Push, then a full barrier,
+ * then read the flag: the workers set it before a last look at the rings, so
+ * either they see the push or the submitter sees the flag.
+ */
+#define AS_SYS_SQ_WORKERS_IDLE (1U << 1)
+/*
+ * Set in the flags of the completion ring's header when its eventfd was
+ * signaled, further completions don't signal it again until it is cleared.
+ * After reading the eventfd, clear it before reaping so no completion goes
+ * unnoticed. GETEVENTS clears it too.
+ */
+#define AS_SYS_CQ_EVENTFD_SIGNALED (1U << 0)
+
+#define AS_SYS_MMAP_RING_BITS 8
+#define AS_SYS_MMAP_PGOFF(ctx, ring) \
+	(((__u64)(ctx) << AS_SYS_MMAP_RING_BITS) | (ring))
+
+/*
+ * For AS_SYS_REGISTER_BUFFERS data points to nr struct iovec, for
+ * AS_SYS_REGISTER_FILES to nr int fds. Each may only be registered once per
+ * context, what was registered is released with the context.
+ */
+#define AS_SYS_MAX_REGISTERED 1024
+
+struct _async_register {
+	async_context_t ctx;
+	const void *data;
+	unsigned int nr;
+};
+
+/* Only one eventfd per context, it is released with the context. */
+struct _async_eventfd {
+	async_context_t ctx;
+	int fd;
+};
+
+#define AS_SYS_STATS_LATENCY_BUCKETS 24
+
+/* Everything but ctx is filled in by the kernel, counting since setup. */
+struct _async_stats {
+	async_context_t ctx;
+	__u64 submitted; /* Calls taken off the submission rings. */
+	__u64 completed; /* Events posted. */
+	/* Times calls were held back for lack of room on the completion ring. */
+	__u64 cq_full_stalls;
+	/* Extra tries posting events, only a ring being written over takes any. */
+	__u64 post_spins;
+	__u64 busy_ns; /* Time workers spent running the context's calls. */
+	/* Right now. */
+	__u64 sq_depth;
+	__u64 cq_depth;
+	__u64 inflight;
+	/*
+	 * Calls by microseconds from being taken off the ring until their event
+	 * was posted: [0] under 1, [i] from 2^(i-1) up to 2^i, the last also
+	 * counting anything slower.
+	 */
+	__u64 latency_us[AS_SYS_STATS_LATENCY_BUCKETS];
+	/* Times the process was woken up for events, see cq_coalesce_nr. */
+	__u64 wakeups;
+	/* Calls run by AS_SYS_SUBMIT itself, see AS_SYS_CB_INLINE. */
+	__u64 inlined;
+};
+
+/*
+ * AS_SYS_CANCEL looks for the first call submitted with user_data, returning
+ * 0 if it was still queued (it completes with -ECANCELED), -EALREADY if it
+ * was already being run (it was interrupted, its completion tells how it
+ * ended) and -ENOENT if there was no such call left.
+ */
+struct _async_cancel {
+	async_context_t ctx;
+	__u64 user_data;
+};
+
+/*
+ * AS_SYS_SUBMIT copies the nr cbs pointed to by cbs onto a submission ring and
+ * hands them to the workers, as pushing them and AS_SYS_NOTIFY would, but
+ * for AS_SYS_CB_INLINE calls it could run itself. It returns how many of the
+ * first cbs were pushed or run, the ring may not have room for all of them
+ * (EAGAIN when it has none) and at most nr_events are taken per call. Chains
+ * are pushed whole or not at all, so the count always ends with one. The
+ * last of the nr cbs ends any chain.
+ *
+ * With max_nr set it then reaps as AS_SYS_GETEVENTS would with min_nr,
+ * max_nr, events and timeout, setting nr_reaped to what GETEVENTS would have
+ * returned (or the negative errno it would have failed with). events may be
+ * NULL to only wait, as with GETEVENTS.
+ */
+struct _async_submit {
+	async_context_t ctx;
+	long nr;
+	struct async_cb **cbs;
+	long min_nr;
+	long max_nr;
+	struct async_event *events;
+	struct timespec *timeout;
+	long nr_reaped;
+};
+
+/*
+ * With events NULL, GETEVENTS only waits for min_nr events and returns how
+ * many are on the completion ring, leaving them there. The process then reads
+ * them in place and hands their slots back itself, see advance_head(), so no
+ * event is copied. Nothing else may reap the ring meanwhile.
+ */
 struct _async_getevents {
 	async_context_t ctx;
 	long min_nr; /* If 0, we won't block, just operates as a check. */
-	long max_nr; /* If 0, will wait until timeout or all events are
-			handled */
-	struct async_event **events;
-	struct timespec *timeout;
+	long max_nr; /* Size of events, no more than this many (at most nr_events) are reaped. */
+	struct async_event *events;
+	struct timespec *timeout; /* If NULL, wait until min_nr are handled. */
 };
 
 #endif
@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "as_sys.h"
+
+static void
+unmap_rings(struct as_sys_ring *ring)
+{
+	unsigned int i;
+
+	for (i = 0; i < ring->nr_sq; i++)
+		if (ring->sq[i])
+			munmap(ring->sq[i], ring->sq_ring_bytes);
+	if (ring->cq)
+		munmap(ring->cq, ring->cq_ring_bytes);
+}
+
+static void *
+map_ring(struct as_sys_ring *ring, unsigned int which, size_t bytes)
+{
+	void *addr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd,
+			AS_SYS_MMAP_PGOFF(ring->ctx, which) * sysconf(_SC_PAGESIZE));
+
+	return addr == MAP_FAILED ? NULL : addr;
+}
+
+int
+as_sys_setup(struct as_sys_ring *ring, unsigned long nr_events,
+		const struct as_sys_params *params)
+{
+	struct _async_setup setup = { .nr_events = nr_events, .ctx_idp = &ring->ctx,
+		.sq_thread_cpu = -1 };
+	unsigned int i;
+	int err;
+
+	memset(ring, 0, sizeof(*ring));
+	if (params) {
+		setup.flags = params->flags;
+		setup.sq_thread_cpu = params->sq_thread_cpu;
+		setup.sq_thread_idle = params->sq_thread_idle;
+		setup.nr_sq_rings = params->nr_sq_rings;
+		setup.numa_node = params->numa_node;
+		setup.syscalls = params->syscalls;
+		setup.nr_syscalls = params->nr_syscalls;
+		setup.cb_timeout_ms = params->cb_timeout_ms;
+		setup.weight = params->weight;
+		setup.max_workers = params->max_workers;
+		setup.cq_coalesce_nr = params->cq_coalesce_nr;
+		setup.cq_coalesce_usecs = params->cq_coalesce_usecs;
+	}
+
+	if ((ring->fd = open(AS_SYS_DEVICE, O_RDWR | O_CLOEXEC)) < 0)
+		return -1;
+	if (ioctl(ring->fd, AS_SYS_SETUP, &setup))
+		goto fail_close;
+
+	ring->flags = setup.flags;
+	ring->nr_events = setup.nr_events;
+	ring->nr_sq = setup.nr_sq_rings;
+	ring->sq_ring_bytes = setup.sq_ring_bytes;
+	ring->cq_ring_bytes = setup.cq_ring_bytes;
+	ring->max_staged = setup.nr_events < AS_SYS_MAX_STAGED ?
+		setup.nr_events : AS_SYS_MAX_STAGED;
+
+	for (i = 0; i < ring->nr_sq; i++)
+		if (!(ring->sq[i] = map_ring(ring, AS_SYS_RING_SQN(i), ring->sq_ring_bytes)))
+			goto fail_destroy;
+	if (!(ring->cq = map_ring(ring, AS_SYS_RING_CQ, ring->cq_ring_bytes)))
+		goto fail_destroy;
+	return 0;
+
+fail_destroy:
+	err = errno;
+	unmap_rings(ring);
+	ioctl(ring->fd, AS_SYS_DESTROY, ring->ctx);
+	errno = err;
+fail_close:
+	err = errno;
+	close(ring->fd);
+	errno = err;
+	return -1;
+}
+
+void
+as_sys_destroy(struct as_sys_ring *ring)
+{
+	unmap_rings(ring);
+	ioctl(ring->fd, AS_SYS_DESTROY, ring->ctx);
+	close(ring->fd);
+}
+
+/* The ring of the cpu we are on, so that threads on other cpus don't contend on it. */
+static circle_buffer *
+submission_ring(struct as_sys_ring *ring)
+{
+	int cpu;
+
+	if (ring->nr_sq == 1 || (cpu = sched_getcpu()) < 0)
+		return ring->sq[0];
+	return ring->sq[cpu % ring->nr_sq];
+}
+
+/* Only wake the poller if it went to sleep, the workers if they went idle. */
+static int
+need_notify(struct as_sys_ring *ring)
+{
+	/* The push has to be visible before we look, see sqpoll.c and worker.c. */
+	__sync_synchronize();
+	if (ring->flags & AS_SYS_SETUP_SQPOLL)
+		return ring->sq[0]->flags & AS_SYS_SQ_NEED_WAKEUP;
+	return ring->sq[0]->flags & AS_SYS_SQ_WORKERS_IDLE;
+}
+
+static int
+cb_linked(const void *cb)
+{
+	return ((const struct async_cb *)cb)->flags & AS_SYS_CB_LINK;
+}
+
+int
+as_sys_submit(struct as_sys_ring *ring)
+{
+	size_t pushed = 0;
+
+	if (ring->nr_staged) {
+		/*
+		 * Chains only go onto a ring whole. Whatever stays staged may
+		 * go to another ring next time, with AS_SYS_SETUP_SQ_PER_CPU.
+		 */
+		pushed = try_push_run(submission_ring(ring), ring->staged,
+				ring->nr_staged, cb_linked);
+		ring->nr_staged -= pushed;
+		memmove(ring->staged, ring->staged + pushed,
+				ring->nr_staged * sizeof(ring->staged[0]));
+	}
+
+	if (need_notify(ring) && ioctl(ring->fd, AS_SYS_NOTIFY, ring->ctx))
+		return -1;
+	return pushed;
+}
+
+int
+as_sys_wait_cqe(struct as_sys_ring *ring, struct async_event *event)
+{
+	return as_sys_wait_cqes(ring, event, 1, 1, NULL) < 0 ? -1 : 0;
+}
+
+long
+as_sys_wait_cqes(struct as_sys_ring *ring, struct async_event *events,
+		long min_nr, long max_nr, struct timespec *timeout)
+{
+	struct _async_getevents getevents;
+	long got, ret;
+
+	got = as_sys_peek_batch_cqe(ring, events, max_nr);
+	if (got >= min_nr)
+		return got;
+
+	getevents.ctx = ring->ctx;
+	getevents.min_nr = min_nr - got;
+	/* GETEVENTS takes no more than the ring holds. */
+	getevents.max_nr = max_nr - got < (long)ring->nr_events ?
+		max_nr - got : (long)ring->nr_events;
+	if (getevents.min_nr > getevents.max_nr)
+		getevents.min_nr = getevents.max_nr;
+	getevents.events = events + got;
+	getevents.timeout = timeout;
+	do {
+		ret = ioctl(ring->fd, AS_SYS_GETEVENTS, &getevents);
+	} while (ret < 0 && errno == EINTR && !timeout);
+
+	if (ret < 0)
+		return got ? got : -1;
+	return got + ret;
+}
+
+long
+as_sys_wait_cq(struct as_sys_ring *ring, long min_nr, struct timespec *timeout)
+{
+	struct _async_getevents getevents = { .ctx = ring->ctx, .min_nr = min_nr,
+		.timeout = timeout };
+	long ret;
+
+	if ((ret = count_entries(ring->cq)) >= min_nr)
+		return ret;
+	do {
+		ret = ioctl(ring->fd, AS_SYS_GETEVENTS, &getevents);
+	} while (ret < 0 && errno == EINTR && !timeout);
+	return ret;
+}
+
+int
+as_sys_register_buffers(struct as_sys_ring *ring, const struct iovec *iovecs,
+		unsigned int nr)
+{
+	struct _async_register reg = { .ctx = ring->ctx, .data = iovecs, .nr = nr };
+
+	return ioctl(ring->fd, AS_SYS_REGISTER_BUFFERS, &reg);
+}
+
+int
+as_sys_register_files(struct as_sys_ring *ring, const int *fds, unsigned int nr)
+{
+	struct _async_register reg = { .ctx = ring->ctx, .data = fds, .nr = nr };
+
+	return ioctl(ring->fd, AS_SYS_REGISTER_FILES, &reg);
+}
+
+int
+as_sys_register_eventfd(struct as_sys_ring *ring, int eventfd)
+{
+	struct _async_eventfd reg = { .ctx = ring->ctx, .fd = eventfd };
+
+	return ioctl(ring->fd, AS_SYS_REGISTER_EVENTFD, &reg);
+}
+
+int
+as_sys_cancel(struct as_sys_ring *ring, __u64 user_data)
+{
+	struct _async_cancel cancel = { .ctx = ring->ctx, .user_data = user_data };
+
+	return ioctl(ring->fd, AS_SYS_CANCEL, &cancel);
+}
+
+int
+as_sys_stats(struct as_sys_ring *ring, struct _async_stats *stats)
+{
+	stats->ctx = ring->ctx;
+	return ioctl(ring->fd, AS_SYS_STATS, stats);
+}
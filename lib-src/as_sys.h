@@ -0,0 +1,201 @@
+#ifndef __LIB_SRC_AS_SYS_H
+#define __LIB_SRC_AS_SYS_H
+
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "../include/as_sys/ioctl.h"
+#include "../shared-libs/circle_buffer.h"
+
+/*
+ * libas_sys: a context of /dev/as_sys with its rings mapped, so submitting and
+ * reaping only go to the kernel when they have to.
+ *
+ * Calls are prepared in the ring's `staged` array with as_sys_get_sqe() and
+ * pushed onto a submission ring by as_sys_submit(), which only notifies the
+ * workers when they aren't polling the ring by themselves. Completions are
+ * popped straight off the completion ring, as_sys_wait_cqe() only blocks in
+ * GETEVENTS once the ring is empty.
+ *
+ * A struct as_sys_ring is not safe to share between threads, give each
+ * thread one of its own (or lock around it).
+ *
+ * Unless noted otherwise calls return 0 on success, -1 with errno set on
+ * failure.
+ */
+
+#define AS_SYS_DEVICE "/dev/as_sys"
+
+/* Most calls get_sqe() hands out before they have to be submitted. */
+#define AS_SYS_MAX_STAGED 64
+
+/* Everything AS_SYS_SETUP takes besides nr_events, see struct _async_setup. */
+struct as_sys_params {
+	unsigned int flags; /* AS_SYS_SETUP_* */
+	int sq_thread_cpu;
+	unsigned int sq_thread_idle;
+	unsigned int nr_sq_rings;
+	int numa_node;
+	const __s32 *syscalls;
+	unsigned int nr_syscalls;
+	unsigned int cb_timeout_ms;
+	unsigned int weight;
+	unsigned int max_workers;
+	unsigned int cq_coalesce_nr;
+	unsigned int cq_coalesce_usecs;
+};
+
+struct as_sys_ring {
+	int fd;
+	async_context_t ctx;
+	unsigned int flags;
+	unsigned long nr_events;
+
+	unsigned int nr_sq;
+	circle_buffer *sq[AS_SYS_MAX_SQ_RINGS];
+	circle_buffer *cq;
+	size_t sq_ring_bytes;
+	size_t cq_ring_bytes;
+
+	/* Handed out by as_sys_get_sqe(), not yet pushed. */
+	unsigned int nr_staged;
+	unsigned int max_staged;
+	struct async_cb staged[AS_SYS_MAX_STAGED];
+};
+
+/*
+ * Open the device, set up a context of at least nr_events and map its rings.
+ * params may be NULL for the defaults.
+ */
+int as_sys_setup(struct as_sys_ring *ring, unsigned long nr_events,
+		const struct as_sys_params *params);
+
+/* Destroy the context and close the device, whatever is in flight is lost. */
+void as_sys_destroy(struct as_sys_ring *ring);
+
+/*
+ * The next call to fill in, zeroed. NULL once AS_SYS_MAX_STAGED (or
+ * nr_events) calls are staged, they have to be submitted first.
+ */
+static inline struct async_cb *
+as_sys_get_sqe(struct as_sys_ring *ring)
+{
+	struct async_cb *cb;
+
+	if (ring->nr_staged == ring->max_staged)
+		return NULL;
+	cb = &ring->staged[ring->nr_staged++];
+	memset(cb, 0, sizeof(*cb));
+	return cb;
+}
+
+static inline void
+as_sys_prep_call(struct async_cb *cb, long number, __u64 user_data)
+{
+	cb->number = number;
+	cb->user_data = user_data;
+}
+
+/*
+ * Push the staged calls and let the workers know. Calls the submission ring
+ * has no room for stay staged, in order. A chain (see AS_SYS_CB_LINK) is
+ * pushed whole or not at all, and not before its last call is staged, so
+ * keep them shorter than AS_SYS_MAX_STAGED.
+ *
+ * The workers hold calls back while the completion ring is full. After making
+ * room with the peek calls alone, submitting (even with nothing staged) or
+ * waiting lets them go again.
+ *
+ * Return:		How many calls were pushed, -1 with errno set if the
+ *			workers couldn't be notified.
+ */
+int as_sys_submit(struct as_sys_ring *ring);
+
+/*
+ * Take a completion if one is ready, without entering the kernel. Also
+ * re-arms a registered eventfd, see AS_SYS_CQ_EVENTFD_SIGNALED.
+ *
+ * Return:		1 if @event was filled in, 0 if there was none.
+ */
+static inline int
+as_sys_peek_cqe(struct as_sys_ring *ring, struct async_event *event)
+{
+	if (ring->cq->flags & AS_SYS_CQ_EVENTFD_SIGNALED)
+		__sync_fetch_and_and(&ring->cq->flags, ~AS_SYS_CQ_EVENTFD_SIGNALED);
+	return try_pop(ring->cq, event);
+}
+
+/* As as_sys_peek_cqe() for up to max completions, returns how many. */
+static inline size_t
+as_sys_peek_batch_cqe(struct as_sys_ring *ring, struct async_event *events,
+		size_t max)
+{
+	if (ring->cq->flags & AS_SYS_CQ_EVENTFD_SIGNALED)
+		__sync_fetch_and_and(&ring->cq->flags, ~AS_SYS_CQ_EVENTFD_SIGNALED);
+	return try_pop_n(ring->cq, events, max);
+}
+
+/*
+ * Look at the i-th ready completion in place, on the ring itself. NULL if
+ * there aren't that many. Looking at the first also re-arms a registered
+ * eventfd, as as_sys_peek_cqe() does.
+ */
+static inline struct async_event *
+as_sys_cqe(struct as_sys_ring *ring, size_t i)
+{
+	if (!i && (ring->cq->flags & AS_SYS_CQ_EVENTFD_SIGNALED))
+		__sync_fetch_and_and(&ring->cq->flags, ~AS_SYS_CQ_EVENTFD_SIGNALED);
+	return peek_slot(ring->cq, ring->cq->head_idx + i);
+}
+
+/*
+ * Done with the first n completions looked at with as_sys_cqe(), their slots
+ * go back to the kernel. Returns how many did.
+ */
+static inline size_t
+as_sys_cqe_seen(struct as_sys_ring *ring, size_t n)
+{
+	return advance_head(ring->cq, n);
+}
+
+/*
+ * Wait until at least min_nr completions are ready without taking any, for
+ * as_sys_cqe(). Gives up after timeout (NULL to wait for as long as it
+ * takes).
+ *
+ * Return:		How many completions are ready, -1 with errno set on
+ *			failure.
+ */
+long as_sys_wait_cq(struct as_sys_ring *ring, long min_nr, struct timespec *timeout);
+
+/* Take the next completion, sleeping in the kernel if none is ready yet. */
+int as_sys_wait_cqe(struct as_sys_ring *ring, struct async_event *event);
+
+/*
+ * Take at least min_nr and up to max_nr completions, giving up after timeout
+ * (NULL to wait for as long as it takes).
+ *
+ * Return:		How many completions were taken, -1 with errno set on
+ *			failure.
+ */
+long as_sys_wait_cqes(struct as_sys_ring *ring, struct async_event *events,
+		long min_nr, long max_nr, struct timespec *timeout);
+
+/* See AS_SYS_REGISTER_BUFFERS, AS_SYS_REGISTER_FILES and AS_SYS_REGISTER_EVENTFD. */
+int as_sys_register_buffers(struct as_sys_ring *ring, const struct iovec *iovecs,
+		unsigned int nr);
+int as_sys_register_files(struct as_sys_ring *ring, const int *fds, unsigned int nr);
+int as_sys_register_eventfd(struct as_sys_ring *ring, int eventfd);
+
+/*
+ * Cancel the call submitted with user_data. Fails with EALREADY if it was
+ * already running (it was interrupted) and ENOENT if it is gone.
+ */
+int as_sys_cancel(struct as_sys_ring *ring, __u64 user_data);
+
+/* The context's counters, see struct _async_stats. */
+int as_sys_stats(struct as_sys_ring *ring, struct _async_stats *stats);
+
+#endif
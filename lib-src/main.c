@@ -1,12 +1,31 @@
-#include <fcntl.h>
 #include <stdio.h>
-#include <sys/ioctl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 
+#include "as_sys.h"
 
+/* Have the module run getuid() for us through libas_sys. */
 int main(void) {
-    int fd = open("/dev/as-sys", 0);
-    if (fd < 0)
-        printf("Unable to open dev file\n");
-    ioctl(fd, 0);
-    return 0;
+	struct as_sys_ring ring;
+	struct async_event event;
+	struct async_cb *cb;
+
+	if (as_sys_setup(&ring, 8, NULL)) {
+		perror("as_sys_setup");
+		return 1;
+	}
+
+	cb = as_sys_get_sqe(&ring);
+	as_sys_prep_call(cb, SYS_getuid, 42);
+	if (as_sys_submit(&ring) != 1 || as_sys_wait_cqe(&ring, &event)) {
+		perror("as_sys_submit");
+		as_sys_destroy(&ring);
+		return 1;
+	}
+
+	printf("getuid: %lld (expected %d), user_data: %llu\n",
+			(long long)event.res, getuid(),
+			(unsigned long long)event.user_data);
+	as_sys_destroy(&ring);
+	return 0;
 }
@@ -6,56 +6,681 @@
 
 #include <linux/fs.h>
 #include <linux/stddef.h>
-#include <linux/rwlock.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/sched/mm.h>
+#include <linux/cred.h>
+#include <linux/moduleparam.h>
+#include <linux/log2.h>
+#include <linux/capability.h>
+#include <linux/topology.h>
+#include <linux/eventfd.h>
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/slab.h>
 
 #include <as_sys/ioctl.h>
 
 #include "buffer.h"
 #include "async_queue.h"
+#include "sqpoll.h"
+#include "worker.h"
+#include "registered.h"
+#include "stats.h"
+#include "trace.h"
 #include "shared_libs/circle_buffer.h"
 #include "common.h"
 
-#define QUEUE_SIZE(events) sizeof(circle_buffer) + sizeof(struct async_cb)*events
+/*
+ * Each ring is page aligned so it can be mapped on its own. Its slots are cache
+ * aligned too, the process and the workers move through them concurrently.
+ */
+#define RING_LAYOUT CB_LAYOUT_ALIGNED
+#define RING_SIZE(type, events) \
+	PAGE_ALIGN(circle_buffer_size_layout(sizeof(type), events, RING_LAYOUT))
+#define QUEUE_SIZE(events, nr_sq) \
+	((nr_sq) * RING_SIZE(struct async_cb, events) + \
+	 RING_SIZE(struct async_event, events))
+
+unsigned int max_nr_events = MAX_NR;
+module_param(max_nr_events, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(max_nr_events, "Largest nr_events a context may be set up with (at most 32768)");
+
+/*
+ * A process corrupting its ring can at worst keep a worker from placing an event
+ * for a bit, give up on it rather than spinning forever.
+ */
+#define POST_EVENT_TRIES 1024
+
+/*
+ * The rings stay pinned in memory for as long as the context lives, so charge
+ * them to the user like io_uring and mlock(2) do.
+ *
+ * Return:		false if over RLIMIT_MEMLOCK, else true with @user set to
+ *			the charged user or NULL if exempt.
+ */
+int
+account_locked_pages(unsigned long nr_pages, struct user_struct **user)
+{
+	unsigned long limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+	unsigned long locked, new_locked;
+
+	*user = NULL;
+	if (capable(CAP_IPC_LOCK))
+		return true;
+
+	*user = get_current_user();
+	do {
+		locked = atomic_long_read(&(*user)->locked_vm);
+		new_locked = locked + nr_pages;
+		if (new_locked > limit) {
+			free_uid(*user);
+			return false;
+		}
+	} while (atomic_long_cmpxchg(&(*user)->locked_vm, locked, new_locked) != locked);
+	return true;
+}
+
+void
+unaccount_locked_pages(struct user_struct *user, unsigned long nr_pages)
+{
+	if (!user)
+		return;
+	atomic_long_sub(nr_pages, &user->locked_vm);
+	free_uid(user);
+}
+
+/*
+ * Wake up whoever is waiting to reap events: GETEVENTS, the eventfd and
+ * poll(2). Also called from the coalescing timer, so it must not sleep.
+ */
+static void
+wake_for_events(struct queue_metadata *queue_metadata)
+{
+	struct eventfd_ctx *eventfd;
 
-struct queue_metadata {
-	/**
-	 * @nr_events	Number of supported events in this queue. The user
-	 * space head might lie or be corrupted so we keep redundant copy here.
+	this_cpu_inc(queue_metadata->stats->wakeups);
+
+	/* Only pay for the wakeup when somebody is actually sleeping. */
+	if (wq_has_sleeper(&queue_metadata->event_wait))
+		wake_up(&queue_metadata->event_wait);
+
+	/*
+	 * The flag is only set after the push, so whoever clears it before
+	 * reaping sees this event even if we don't signal for it.
 	 */
-	unsigned long nr_events;
-	circle_buffer *syscall_queue;
-};
+	eventfd = smp_load_acquire(&queue_metadata->eventfd);
+	if (eventfd && !(__sync_fetch_and_or(&queue_metadata->event_queue->flags,
+					AS_SYS_CQ_EVENTFD_SIGNALED) &
+				AS_SYS_CQ_EVENTFD_SIGNALED))
+		eventfd_signal(eventfd, 1);
+
+	rcu_read_lock();
+	if (!READ_ONCE(queue_metadata->dead) && wq_has_sleeper(queue_metadata->file_wait))
+		wake_up(queue_metadata->file_wait);
+	rcu_read_unlock();
+}
+
+static enum hrtimer_restart
+coalesce_timer_fn(struct hrtimer *timer)
+{
+	struct queue_metadata *queue_metadata =
+		container_of(timer, struct queue_metadata, coalesce_timer);
+
+	if (atomic_xchg(&queue_metadata->coalesced, 0))
+		wake_for_events(queue_metadata);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Count a posted event towards the next wakeup, see cq_coalesce_nr. Whoever
+ * takes the count back to 0 does the wakeup. The first event of a batch arms
+ * the timer, which is never cancelled for a batch completed early: firing
+ * for a count that is back to 0 does nothing, while cancelling could take
+ * the timer from under the next batch.
+ */
+static void
+coalesce_event(struct queue_metadata *queue_metadata)
+{
+	unsigned int pending = atomic_inc_return(&queue_metadata->coalesced);
+	unsigned int left = queue_metadata->coalesce_nr - pending;
+	u64 ns = queue_metadata->coalesce_ns;
+	int inflight;
+
+	if (pending >= queue_metadata->coalesce_nr)
+		goto wake;
+
+	if (queue_metadata->coalesce_adaptive) {
+		/* Nothing in flight, nothing more is coming any time soon. */
+		inflight = atomic_read(&queue_metadata->inflight);
+		if (inflight <= 0)
+			goto wake;
+		/* Only wait for as much of the batch as can still come. */
+		if (inflight < left)
+			ns = div_u64(ns * inflight, left);
+	}
+
+	if (pending == 1)
+		hrtimer_start(&queue_metadata->coalesce_timer, ns_to_ktime(ns),
+				HRTIMER_MODE_REL);
+	return;
+
+wake:
+	if (atomic_xchg(&queue_metadata->coalesced, 0))
+		wake_for_events(queue_metadata);
+}
+
+static void
+release_async_queue(struct buffer_slab *buffer_slab)
+{
+	struct queue_metadata *queue_metadata = buffer_slab->kernel_buffer;
+
+	/*
+	 * Kick out anyone still blocked in GETEVENTS on this context, workers
+	 * see the flag as well and stop taking its submissions.
+	 */
+	queue_metadata->dead = true;
+	wake_up_all(&queue_metadata->event_wait);
+	stop_sqpoll(buffer_slab);
+}
+
+static void
+destroy_async_queue(struct buffer_slab *buffer_slab)
+{
+	struct queue_metadata *queue_metadata = buffer_slab->kernel_buffer;
+
+	/* No worker can be running on our behalf anymore, nor post to arm it. */
+	hrtimer_cancel(&queue_metadata->coalesce_timer);
+	unregister_all(queue_metadata);
+	unaccount_locked_pages(queue_metadata->user, queue_metadata->locked_pages);
+	put_cred(queue_metadata->cred);
+	mmdrop(queue_metadata->mm);
+	put_task_struct(queue_metadata->task);
+	free_percpu(queue_metadata->stats);
+	kfree(queue_metadata->allowed);
+}
 
 int
-init_async_queue(unsigned long nr_events, struct file *file, async_context_t *ctx_id)
+init_async_queue(struct _async_setup *setup, unsigned long *allowed,
+		struct file *file, async_context_t *ctx_id)
 {
 	struct buffer_slab *buffer_slab;
 	struct queue_metadata *queue_metadata;
+	/* The rings are powers of two anyway, let the caller use all of it. */
+	unsigned long nr_events = roundup_pow_of_two(setup->nr_events);
+	unsigned int nr_sq = 1;
+	int node = setup->flags & AS_SYS_SETUP_NUMA_NODE ?
+		setup->numa_node : numa_node_id();
+	unsigned long locked_pages;
+	struct user_struct *user;
+	struct queue_stats __percpu *stats;
+	unsigned int ring_flags;
+	unsigned int ring;
+	int err;
+
+	/* Ring slots are meant to line up with cache lines. */
+	BUILD_BUG_ON(sizeof(struct async_cb) != 64);
+	BUILD_BUG_ON(sizeof(struct async_event) != 16);
+
+	if (setup->flags & AS_SYS_SETUP_SQ_PER_CPU) {
+		nr_sq = setup->nr_sq_rings ? setup->nr_sq_rings : num_online_cpus();
+		nr_sq = min_t(unsigned int, nr_sq, AS_SYS_MAX_SQ_RINGS);
+	}
+	locked_pages = QUEUE_SIZE(nr_events, nr_sq) >> PAGE_SHIFT;
+
+	if (!account_locked_pages(locked_pages, &user))
+		return -ENOMEM;
+
+	if (!(stats = alloc_percpu(struct queue_stats))) {
+		unaccount_locked_pages(user, locked_pages);
+		return -ENOMEM;
+	}
 
 	/* First try creating the buffer region for us to store the queue. */
-	/* NOTE: We should be given the buffer_slab holding its lock. */
-	if (!alloc_buffer(QUEUE_SIZE(nr_events), sizeof(struct queue_metadata),
-				file, &buffer_slab))
-		return false;
+	if (!alloc_buffer(QUEUE_SIZE(nr_events, nr_sq), sizeof(struct queue_metadata),
+				node, file, &buffer_slab)) {
+		free_percpu(stats);
+		unaccount_locked_pages(user, locked_pages);
+		return -ENOMEM;
+	}
 
 	/* Fill in the metadata head of the queue. */
 	queue_metadata = buffer_slab->kernel_buffer;
 	queue_metadata->nr_events = nr_events;
+	queue_metadata->user = user;
+	queue_metadata->locked_pages = locked_pages;
+	queue_metadata->nr_sq = nr_sq;
+	queue_metadata->numa_node = node;
+	queue_metadata->sq_ring_bytes = RING_SIZE(struct async_cb, nr_events);
+	queue_metadata->cq_ring_bytes = RING_SIZE(struct async_event, nr_events);
 	queue_metadata->syscall_queue = buffer_slab->user_buffer;
-	init_buffer((circle_buffer*)&queue_metadata->syscall_queue, sizeof(struct async_cb), nr_events);
+	queue_metadata->event_queue = buffer_slab->user_buffer +
+		queue_metadata->sq_ring_bytes;
+	ring_flags = RING_LAYOUT;
+	if (setup->flags & AS_SYS_SETUP_RING_SPIN)
+		ring_flags |= CB_WAIT_SPIN;
+	for (ring = 0; ring < nr_sq; ring++)
+		init_buffer_layout(syscall_ring(queue_metadata, ring),
+				sizeof(struct async_cb), nr_events, ring_flags);
+	init_buffer_layout(queue_metadata->event_queue, sizeof(struct async_event),
+			nr_events, ring_flags);
+	/*
+	 * Nobody has mapped the rings yet, the headers can still be trusted.
+	 * All submission rings share the first one's geometry.
+	 */
+	get_geometry(queue_metadata->syscall_queue, &queue_metadata->syscall_geo);
+	get_geometry(queue_metadata->event_queue, &queue_metadata->event_geo);
+	/* No worker has the context yet. */
+	queue_metadata->syscall_queue->flags = AS_SYS_SQ_WORKERS_IDLE;
+	init_waitqueue_head(&queue_metadata->event_wait);
+	queue_metadata->dead = false;
+	queue_metadata->file_wait = buffer_file_wait(file);
+	atomic_set(&queue_metadata->inflight, 0);
+	INIT_LIST_HEAD(&queue_metadata->run_list);
+	queue_metadata->queued = false;
+	queue_metadata->weight = setup->weight ? setup->weight : 1;
+	queue_metadata->credit = queue_metadata->weight;
+	queue_metadata->max_workers = setup->max_workers;
+	atomic_set(&queue_metadata->active_workers, 0);
+	queue_metadata->kick_missed = false;
+	queue_metadata->self = buffer_slab;
+	queue_metadata->sqpoll = NULL;
+	queue_metadata->registered_buffers = NULL;
+	queue_metadata->registered_files = NULL;
+	queue_metadata->eventfd = NULL;
+	queue_metadata->stats = stats;
+	queue_metadata->allowed = allowed;
+	queue_metadata->cb_timeout = msecs_to_jiffies(setup->cb_timeout_ms);
+	/* Waiting for more events than the ring holds would only ever time out. */
+	queue_metadata->coalesce_nr = min_t(unsigned long, setup->cq_coalesce_nr, nr_events);
+	queue_metadata->coalesce_ns = (u64)setup->cq_coalesce_usecs * NSEC_PER_USEC;
+	queue_metadata->coalesce_adaptive = setup->flags & AS_SYS_SETUP_CQ_ADAPTIVE;
+	atomic_set(&queue_metadata->coalesced, 0);
+	hrtimer_init(&queue_metadata->coalesce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	queue_metadata->coalesce_timer.function = coalesce_timer_fn;
+
+	/*
+	 * Workers run the submissions as this process. Only the bare structs
+	 * are pinned, the address space, files and fs_struct are looked up
+	 * again for each submission so that a context left behind by an exiting process
+	 * doesn't keep them alive (the mapped rings would then keep our file
+	 * from ever being released).
+	 */
+	queue_metadata->task = current->group_leader;
+	get_task_struct(queue_metadata->task);
+	queue_metadata->mm = current->mm;
+	mmgrab(queue_metadata->mm);
+	queue_metadata->cred = get_current_cred();
+
+	buffer_slab->release = release_async_queue;
+	buffer_slab->destroy = destroy_async_queue;
 
-	*ctx_id = buffer_slab->key.buffer_uid;
-	/* We have set up our queue manager for the buffer_slab. We can release
-	 * its lock.
+	setup->nr_events = nr_events;
+	setup->nr_sq_rings = nr_sq;
+	setup->numa_node = node;
+	setup->sq_ring_bytes = queue_metadata->sq_ring_bytes;
+	setup->cq_ring_bytes = queue_metadata->cq_ring_bytes;
+	*ctx_id = buffer_slab->id;
+	/*
+	 * We have set up our queue manager for the buffer_slab, let it be
+	 * found. Another thread may destroy it from then on, keep it pinned
+	 * until we are done with it.
 	 */
-	write_unlock(&buffer_slab->rwlock);
+	hold_buffer(buffer_slab);
+	publish_buffer(buffer_slab, file);
+
+	if ((setup->flags & AS_SYS_SETUP_SQPOLL) && !start_sqpoll(buffer_slab, setup)) {
+		deinit_async_queue(file, *ctx_id);
+		put_async_queue(buffer_slab);
+		return -ENOMEM;
+	}
+	put_async_queue(buffer_slab);
 	return true;
 }
 
 void
 deinit_async_queue(struct file *file, async_context_t ctx_id)
 {
-	read_lock(&file->f_owner.lock);
 	free_buffer(ctx_id, file);
-	read_unlock(&file->f_owner.lock);
+}
+
+/**
+ * get_async_queue() - Find the queue of a context owned by this file and pin it
+ * @file		The file the context was set up on
+ * @ctx_id		The context to look up
+ * @queue		Set to the pinned queue on success
+ */
+int
+get_async_queue(struct file *file, async_context_t ctx_id, struct buffer_slab **queue)
+{
+	return get_buffer(file, ctx_id, queue);
+}
+
+/**
+ * map_async_queue() - mmap(2) handler sharing a context's ring with the process
+ * @file		The device file the context was set up on
+ * @vma			Area to map, its page offset is an AS_SYS_MMAP_PGOFF()
+ */
+int
+map_async_queue(struct file *file, struct vm_area_struct *vma)
+{
+	async_context_t ctx_id = vma->vm_pgoff >> AS_SYS_MMAP_RING_BITS;
+	unsigned int ring = vma->vm_pgoff & ((1UL << AS_SYS_MMAP_RING_BITS) - 1);
+	struct buffer_slab *queue;
+	struct queue_metadata *queue_metadata;
+	int ret;
+
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+	if (!get_async_queue(file, ctx_id, &queue))
+		return -EINVAL;
+
+	queue_metadata = queue->kernel_buffer;
+	switch (ring) {
+		case AS_SYS_RING_SQ:
+			ret = map_user_buffer(queue, vma, 0,
+					queue_metadata->sq_ring_bytes);
+			break;
+		case AS_SYS_RING_CQ:
+			ret = map_user_buffer(queue, vma,
+					queue_metadata->sq_ring_bytes,
+					queue_metadata->cq_ring_bytes);
+			break;
+		default:
+			/* The further submission rings follow the completion ring. */
+			if (ring - 1 >= queue_metadata->nr_sq) {
+				ret = -EINVAL;
+				break;
+			}
+			ret = map_user_buffer(queue, vma,
+					(void *)syscall_ring(queue_metadata, ring - 1) -
+					queue->user_buffer,
+					queue_metadata->sq_ring_bytes);
+	}
+
+	put_async_queue(queue);
+	return ret;
+}
+
+/**
+ * post_event() - Place a finished syscall's result onto the completion ring
+ *
+ * Room for the event was reserved by try_get_submission(), so the push only
+ * fails if the process has been writing over the ring.
+ */
+void
+post_event(struct buffer_slab *queue, struct async_event *async_event,
+		u64 dispatched)
+{
+	struct queue_metadata *queue_metadata = queue->kernel_buffer;
+	u64 latency = ktime_get_ns() - dispatched;
+	unsigned int tries = 0;
+
+	while (!try_push_geo(queue_metadata->event_queue,
+				&queue_metadata->event_geo, async_event)) {
+		if (++tries == POST_EVENT_TRIES) {
+			mpr_warn("Dropping event for corrupted ring of context %lu\n",
+					queue->id);
+			break;
+		}
+		cpu_relax();
+	}
+	atomic_dec(&queue_metadata->inflight);
+
+	if (tries)
+		this_cpu_add(queue_metadata->stats->post_spins, tries);
+	this_cpu_inc(queue_metadata->stats->completed);
+	this_cpu_inc(queue_metadata->stats->latency[latency_bucket(latency)]);
+	trace_as_sys_complete(queue->id, async_event->user_data, async_event->res,
+			latency);
+
+	if (queue_metadata->coalesce_nr > 1)
+		coalesce_event(queue_metadata);
+	else
+		wake_for_events(queue_metadata);
+}
+
+static int
+has_events(struct buffer_slab *queue)
+{
+	struct queue_metadata *queue_metadata = queue->kernel_buffer;
+
+	return !queue_metadata->dead &&
+		count_entries_geo(queue_metadata->event_queue, &queue_metadata->event_geo);
+}
+
+/**
+ * poll_async_queues() - poll(2) handler for the device file
+ *
+ * Readable while any context set up on the file has events to reap, so an
+ * event loop can watch them all with a single fd.
+ */
+__poll_t
+poll_async_queues(struct file *file, poll_table *wait)
+{
+	poll_wait(file, buffer_file_wait(file), wait);
+	return buffer_any(file, has_events) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+/**
+ * reserve_event() - Reserve room for another event of a running submission
+ *
+ * The links of a chain need an event each, only the first was reserved by
+ * try_get_submission(). Nothing tells us when the process reaps, so with the
+ * event queue full we look again every jiffy.
+ *
+ * Return:		false if the context was destroyed meanwhile.
+ */
+int
+reserve_event(struct buffer_slab *queue)
+{
+	struct queue_metadata *queue_metadata = queue->kernel_buffer;
+
+	if (try_reserve_event(queue_metadata))
+		return true;
+
+	this_cpu_inc(queue_metadata->stats->cq_full_stalls);
+	do {
+		if (queue_metadata->dead)
+			return false;
+		schedule_timeout_interruptible(1);
+	} while (!try_reserve_event(queue_metadata));
+	return true;
+}
+
+static int
+cb_linked(const void *elem)
+{
+	return ((const struct async_cb *)elem)->flags & AS_SYS_CB_LINK;
+}
+
+/**
+ * try_get_submission() - Take the next submission off a context's queue
+ * @queue		A pinned queue
+ * @cbs			Where to copy the submission to
+ * @max			Room in @cbs, at least 1
+ *
+ * A chain of AS_SYS_CB_LINK submissions comes out whole, up to @max. Only
+ * the first's event is reserved, see reserve_event().
+ *
+ * Return:		The number of submissions taken, 0 if there is nothing
+ *			queued, the context is being destroyed, or taking more
+ *			could leave an event without room on event_queue.
+ */
+size_t
+try_get_submission(struct buffer_slab *queue, struct async_cb *cbs, size_t max)
+{
+	struct queue_metadata *queue_metadata = queue->kernel_buffer;
+	unsigned int first, ring;
+	size_t nr;
+
+	if (queue_metadata->dead)
+		return 0;
+
+	/* Claim room for the event first, the reaper only ever frees more. */
+	if (!try_reserve_event(queue_metadata)) {
+		this_cpu_inc(queue_metadata->stats->cq_full_stalls);
+		return 0;
+	}
+
+	/*
+	 * Start with the ring of the cpu we are on, it is the one most likely
+	 * to have just been pushed to from here. Steal from the others when it
+	 * runs dry.
+	 */
+	first = raw_smp_processor_id() % queue_metadata->nr_sq;
+	ring = first;
+	do {
+		if ((nr = try_pop_run_geo(syscall_ring(queue_metadata, ring),
+				&queue_metadata->syscall_geo, cbs, max, cb_linked))) {
+			this_cpu_add(queue_metadata->stats->submitted, nr);
+			trace_as_sys_dispatch(queue->id, cbs[0].number, cbs[0].user_data,
+					nr, atomic_read(&queue_metadata->inflight));
+			return nr;
+		}
+		if (++ring == queue_metadata->nr_sq)
+			ring = 0;
+	} while (ring != first);
+
+	atomic_dec(&queue_metadata->inflight);
+	return 0;
+}
+
+/**
+ * submit_calls() - Push submissions for a process that doesn't map the rings
+ * @queue		A queue pinned with get_async_queue()
+ * @cbs			The submissions, already copied into the kernel
+ * @nr			How many
+ *
+ * They go onto the ring of the cpu we are on, as libas_sys would push them,
+ * in one go. Chains only go on whole, one still open at the end of @cbs isn't
+ * pushed. The caller still has to hand them to the workers.
+ *
+ * Return:		How many of the first cbs were pushed, up to the end of
+ *			the last chain there was room for. 0 if the ring is
+ *			full or the context is being destroyed.
+ */
+size_t
+submit_calls(struct buffer_slab *queue, struct async_cb *cbs, size_t nr)
+{
+	struct queue_metadata *queue_metadata = queue->kernel_buffer;
+
+	if (queue_metadata->dead)
+		return 0;
+	return try_push_run_geo(syscall_ring(queue_metadata,
+				raw_smp_processor_id() % queue_metadata->nr_sq),
+			&queue_metadata->syscall_geo, cbs, nr, cb_linked);
+}
+
+/*
+ * Mark the first cb with user_data still on one of the rings canceled.
+ * Return:		0 if no worker can have taken it before it was marked,
+ *			-EALREADY if one may have, -ENOENT if there was none.
+ */
+static int
+cancel_queued(struct queue_metadata *queue_metadata, __u64 user_data)
+{
+	circle_buffer *syscall_queue;
+	struct async_cb *cb;
+	size_t head, pos, nr;
+	unsigned int ring;
+
+	for (ring = 0; ring < queue_metadata->nr_sq; ring++) {
+		syscall_queue = syscall_ring(queue_metadata, ring);
+		head = READ_ONCE(syscall_queue->head_idx);
+		/* The indices are the process' to scribble on, never look past one lap. */
+		nr = min_t(size_t, READ_ONCE(syscall_queue->tail_idx) - head,
+				queue_metadata->syscall_geo.mask + 1);
+		for (pos = head; pos != head + nr; pos++) {
+			cb = peek_slot_geo(syscall_queue, &queue_metadata->syscall_geo, pos);
+			if (!cb || READ_ONCE(cb->user_data) != user_data ||
+			    (READ_ONCE(cb->flags) & AS_SYS_CB_CANCELED))
+				continue;
+
+			__sync_fetch_and_or(&cb->flags, AS_SYS_CB_CANCELED);
+			/*
+			 * A worker claims the slot before copying it out, so if
+			 * it is still unclaimed after the mark its copy has it.
+			 */
+			smp_mb();
+			if ((long)(READ_ONCE(syscall_queue->head_idx) - pos) <= 0)
+				return 0;
+			return -EALREADY;
+		}
+	}
+	return -ENOENT;
+}
+
+/**
+ * cancel_submission() - Cancel a call by the user_data it was submitted with
+ *
+ * Calls still on a ring are marked AS_SYS_CB_CANCELED in place, those a
+ * worker took already are looked for among what the workers run.
+ */
+int
+cancel_submission(struct buffer_slab *queue, __u64 user_data)
+{
+	struct queue_metadata *queue_metadata = queue->kernel_buffer;
+	int queued, running;
+
+	if (!(queued = cancel_queued(queue_metadata, user_data)))
+		return 0;
+	/* Taken off the ring, maybe before it was marked. */
+	running = cancel_running(queue_metadata, user_data);
+	return running == -ENOENT ? queued : running;
+}
+
+/**
+ * try_get_events() - Take up to @max ready events off the completion ring
+ *
+ * Return:		How many events were placed in @events.
+ */
+size_t
+try_get_events(struct buffer_slab *queue, struct async_event *events, size_t max)
+{
+	struct queue_metadata *queue_metadata = queue->kernel_buffer;
+
+	/* Before reaping, see post_event(). */
+	if (queue_metadata->eventfd)
+		__sync_fetch_and_and(&queue_metadata->event_queue->flags,
+				~AS_SYS_CQ_EVENTFD_SIGNALED);
+	return try_pop_n_geo(queue_metadata->event_queue, &queue_metadata->event_geo,
+			events, max);
+}
+
+/**
+ * wait_for_events() - Block until enough events are ready to be reaped
+ * @queue		A queue pinned with get_async_queue()
+ * @min_nr		Number of events to wait for, clamped to the ring size
+ * @timeout		Maximum time to sleep in jiffies
+ *
+ * Return:		0 on timeout, -ERESTARTSYS if interrupted by a signal,
+ *			-EINVAL if the context was destroyed and a positive
+ *			value otherwise.
+ */
+long
+wait_for_events(struct buffer_slab *queue, unsigned long min_nr, long timeout)
+{
+	struct queue_metadata *queue_metadata = queue->kernel_buffer;
+	long ret;
+
+	if (!min_nr)
+		return 1;
+	min_nr = min(min_nr, queue_metadata->nr_events);
+
+	ret = wait_event_interruptible_timeout(queue_metadata->event_wait,
+			count_entries_geo(queue_metadata->event_queue,
+				&queue_metadata->event_geo) >= min_nr ||
+			queue_metadata->dead,
+			timeout);
+
+	if (ret > 0 && queue_metadata->dead)
+		return -EINVAL;
+	return ret;
 }
@@ -8,26 +8,270 @@
 #define __Module_SRC_ASYNC_QUEUE_H
 
 #include <linux/fs.h>
+#include <linux/wait.h>
+#include <linux/list.h>
+#include <linux/sched.h>
+#include <linux/cred.h>
+#include <linux/eventfd.h>
+#include <linux/poll.h>
+#include <linux/hrtimer.h>
 #include <as_sys/ioctl.h>
 #include "buffer.h"
+#include "stats.h"
+#include "shared_libs/circle_buffer.h"
 
-#define MAX_NR 10
+/* Entries a context's rings may be set up with, see the max_nr_events parameter. */
+#define MAX_NR 32768
+extern unsigned int max_nr_events;
 
-static inline int init_async_queue_file(struct file *file) 
+/* The kernel_buffer of every buffer_slab holding a context. */
+struct queue_metadata {
+	/**
+	 * @nr_events	Number of supported events in this queue. The user
+	 * space head might lie or be corrupted so we keep redundant copy here.
+	 */
+	unsigned long nr_events;
+	/*
+	 * The caller's struct async_cb waiting to be run, nr_sq
+	 * rings of them, see syscall_ring(). The first also carries the
+	 * AS_SYS_SQ_NEED_WAKEUP and AS_SYS_SQ_WORKERS_IDLE flags.
+	 */
+	circle_buffer *syscall_queue;
+	unsigned int nr_sq;
+	/* Completed syscalls waiting to be reaped by GETEVENTS. */
+	circle_buffer *event_queue;
+	/* Our copies of the ring layouts, their headers are the process' to scribble on. */
+	struct cb_geometry syscall_geo;
+	struct cb_geometry event_geo;
+	size_t sq_ring_bytes;
+	size_t cq_ring_bytes;
+	/* Where the rings live and the workers running the context are. */
+	int numa_node;
+	/* Woken whenever an event is posted or the context is torn down. */
+	wait_queue_head_t event_wait;
+	bool dead;
+	/* poll(2) on the file, only to be woken while !dead, see buffer_file_wait(). */
+	wait_queue_head_t *file_wait;
+	/*
+	 * Calls taken off the syscall_queue whose event isn't posted yet,
+	 * together with the events already posted this can't exceed
+	 * nr_events so a worker never has to wait on the event_queue.
+	 */
+	atomic_t inflight;
+
+	/* The process submissions are run on behalf of, captured at setup. */
+	struct task_struct *task;
+	struct mm_struct *mm;
+	const struct cred *cred;
+	/* Charged locked_pages for the rings against RLIMIT_MEMLOCK, NULL if exempt. */
+	struct user_struct *user;
+	unsigned long locked_pages;
+
+	/* With AS_SYS_SETUP_SQPOLL, the thread polling syscall_queue. */
+	struct task_struct *sqpoll;
+	wait_queue_head_t sqpoll_wait;
+	unsigned long sqpoll_idle;
+
+	/*
+	 * What AS_SYS_REGISTER_BUFFERS and AS_SYS_REGISTER_FILES took for the
+	 * fixed calls, set once and then left alone until the context is
+	 * freed. See registered.c.
+	 */
+	struct registered_buffers *registered_buffers;
+	struct registered_files *registered_files;
+	/* From AS_SYS_REGISTER_EVENTFD, signaled as events are posted. */
+	struct eventfd_ctx *eventfd;
+
+	/*
+	 * With cq_coalesce_nr > 1, events posted since the process was last
+	 * woken up and the timer waking it up for them anyway, see
+	 * post_event().
+	 */
+	unsigned int coalesce_nr;
+	u64 coalesce_ns;
+	bool coalesce_adaptive;
+	atomic_t coalesced;
+	struct hrtimer coalesce_timer;
+
+	/* For AS_SYS_CB_TIMEOUT, in jiffies, 0 if unset. */
+	unsigned long cb_timeout;
+
+	/* With AS_SYS_SETUP_ALLOWLIST, the syscalls it may run, else NULL. */
+	unsigned long *allowed;
+
+	/* Counters for AS_SYS_STATS. */
+	struct queue_stats __percpu *stats;
+
+	/*
+	 * Links the context into the worker pool while it has work queued.
+	 * The pool takes up to weight submissions off it in a row (credit are
+	 * those left) before moving on, and never runs more than max_workers
+	 * (if set) of them at once, see worker.c. kick_missed tells the last
+	 * of those max_workers that a kick was turned away meanwhile.
+	 */
+	struct list_head run_list;
+	bool queued;
+	unsigned int weight;
+	unsigned int credit;
+	unsigned int max_workers;
+	atomic_t active_workers;
+	bool kick_missed;
+	struct buffer_slab *self;
+};
+
+static inline struct queue_metadata *
+to_queue_metadata(struct buffer_slab *queue)
+{
+	return queue->kernel_buffer;
+}
+
+/*
+ * The rings are laid out in the order they are numbered for mmap(2): the first
+ * submission ring, the completion ring, then any further submission rings.
+ */
+static inline circle_buffer *
+syscall_ring(struct queue_metadata *queue_metadata, unsigned int ring)
+{
+	if (!ring)
+		return queue_metadata->syscall_queue;
+	return (void *)queue_metadata->event_queue + queue_metadata->cq_ring_bytes +
+		(ring - 1) * queue_metadata->sq_ring_bytes;
+}
+
+static inline bool
+submissions_pending(struct queue_metadata *queue_metadata)
+{
+	unsigned int ring;
+
+	for (ring = 0; ring < queue_metadata->nr_sq; ring++)
+		if (!is_empty(syscall_ring(queue_metadata, ring)))
+			return true;
+	return false;
+}
+
+/* Submissions waiting on all of the rings together. */
+static inline size_t
+submissions_queued(struct queue_metadata *queue_metadata)
+{
+	unsigned int ring;
+	size_t nr = 0;
+
+	for (ring = 0; ring < queue_metadata->nr_sq; ring++)
+		nr += count_entries_geo(syscall_ring(queue_metadata, ring),
+				&queue_metadata->syscall_geo);
+	return nr;
+}
+
+/* Events waiting on the completion ring. */
+static inline size_t
+events_queued(struct queue_metadata *queue_metadata)
+{
+	return count_entries_geo(queue_metadata->event_queue, &queue_metadata->event_geo);
+}
+
+/*
+ * Claim room on the completion ring for the event of a call about to be run,
+ * post_event() gives it back. Undo with unreserve_event() if the call isn't.
+ */
+static inline int
+try_reserve_event(struct queue_metadata *queue_metadata)
+{
+	if (atomic_inc_return(&queue_metadata->inflight) +
+	    events_queued(queue_metadata) > queue_metadata->nr_events) {
+		atomic_dec(&queue_metadata->inflight);
+		return false;
+	}
+	return true;
+}
+
+static inline void
+unreserve_event(struct queue_metadata *queue_metadata)
+{
+	atomic_dec(&queue_metadata->inflight);
+}
+
+static inline int init_async_queue_file(struct file *file)
 {
 	return buffer_init_file(file);
 }
-static inline void deinit_async_queue_file(struct file *file) 
+static inline void deinit_async_queue_file(struct file *file)
 {
 	buffer_free_file(file);
 }
 
-/* Initilize the asynchronous queue with the given buffer and events size. */
-int init_async_queue(unsigned long nr_events, struct file *file, async_context_t *ctx_id);
+/*
+ * Initilize the asynchronous queue with the given buffer and events size,
+ * filling in the ring sizes of setup. Returns 0 or a negative errno.
+ */
+int init_async_queue(struct _async_setup *setup, unsigned long *allowed,
+		struct file *file, async_context_t *ctx_id);
 void deinit_async_queue(struct file *file, async_context_t ctx_id);
 
+/*
+ * Look up and pin the queue of the given context. The queue stays valid until
+ * released with put_async_queue() even if the context is destroyed meanwhile.
+ */
+int get_async_queue(struct file *file, async_context_t ctx_id, struct buffer_slab **queue);
+static inline void put_async_queue(struct buffer_slab *queue)
+{
+	put_buffer(queue);
+}
 
-/* Try to get an event, if unable then fail out. */
-int try_get_event(struct file *file, async_context_t ctx_id, struct async_event *async_event);
+/*
+ * Charge pages pinned for a context to the calling user's RLIMIT_MEMLOCK. On
+ * success @user is set to who to unaccount them from later, NULL if exempt.
+ */
+int account_locked_pages(unsigned long nr_pages, struct user_struct **user);
+void unaccount_locked_pages(struct user_struct *user, unsigned long nr_pages);
+
+/* Map one of the context's rings into the calling process, see AS_SYS_MMAP_PGOFF. */
+int map_async_queue(struct file *file, struct vm_area_struct *vma);
+
+/*
+ * Post a completed event to the queue, waking anyone waiting on it. Its call
+ * was taken off the ring at @dispatched, in ktime_get_ns().
+ */
+void post_event(struct buffer_slab *queue, struct async_event *async_event,
+		u64 dispatched);
+
+/* poll(2) handler, readable while any of the file's contexts has events. */
+__poll_t poll_async_queues(struct file *file, poll_table *wait);
+
+/*
+ * Push submissions copied in from the process onto the ring of the cpu we are
+ * on, returns how many fit.
+ */
+size_t submit_calls(struct buffer_slab *queue, struct async_cb *cbs, size_t nr);
+
+/*
+ * Take the next submission (or chain of them, up to max) off the context's
+ * queue, reserving room for the first's event. Once run, each result must be
+ * handed to post_event().
+ */
+size_t try_get_submission(struct buffer_slab *queue, struct async_cb *cbs, size_t max);
+
+/*
+ * Reserve room for one more event while running a submission, waiting for
+ * the process to reap if need be. False if the context is gone.
+ */
+int reserve_event(struct buffer_slab *queue);
+
+/*
+ * Cancel the first call submitted with user_data, returns what AS_SYS_CANCEL
+ * does.
+ */
+int cancel_submission(struct buffer_slab *queue, __u64 user_data);
+
+/*
+ * Take whatever events are ready, up to max, without waiting for more.
+ * Re-arms the eventfd, see AS_SYS_CQ_EVENTFD_SIGNALED.
+ */
+size_t try_get_events(struct buffer_slab *queue, struct async_event *events, size_t max);
+
+/*
+ * Sleep until at least min_nr events are ready, the timeout (in jiffies)
+ * expires, or the context is destroyed.
+ */
+long wait_for_events(struct buffer_slab *queue, unsigned long min_nr, long timeout);
 
 #endif
@@ -4,334 +4,437 @@
  * This file is released under the GPLv2
  */
 
+#include <linux/kernel.h>
 #include <linux/list.h>
-#include <linux/rbtree.h>
+#include <linux/idr.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
 #include <linux/file.h>
-#include <linux/mutex.h>
 #include <linux/gfp.h>
 #include <linux/slab.h>
-#include <linux/pid.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/percpu-refcount.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
 #include <linux/stddef.h>
 
 #include "buffer.h"
 #include "common.h"
 
-// TODO: Create global map for id->void* of allocated buffers.
-struct {
-	rwlock_t lock;
+/*
+ * Hung off file->private_data, maps the ids handed out to the process to its
+ * buffers. Lookups only take the RCU read lock, the spinlock serializes
+ * changes to the map.
+ */
+struct buffer_map {
+	spinlock_t lock;
+	struct idr idr;
+	/* See buffer_file_wait(). */
+	wait_queue_head_t poll_wait;
+	struct rcu_head rcu;
+	/* Tags the next id handed out, under the lock. */
+	unsigned int generation;
+};
 
-	struct rb_root _root;
-	buffer_id_t _uid_counter;
-} map_wrapper = {
-	RW_DEP_MAP_INIT(map_wrapper.lock)
-	._root = {NULL},
-	._uid_counter = 0
+struct kernel_data {
+	struct buffer_slab buffer;
+	char kernel_buffer[0]; // Variable length attr.
 };
 
-static inline buffer_id_t gen_next_map_id(void)
+/*
+ * The last reference may be put from any context, freeing sleeps (the destroy
+ * hook, vfree()) so it is left to this.
+ */
+static struct workqueue_struct *free_wq;
+
+/*
+ * Processes open files and set up contexts at high rates, keep what that
+ * allocates out of the general kmalloc caches. Every buffer's kernel_buffer
+ * is the size given to init_buffers().
+ */
+static struct kmem_cache *buffer_map_cache;
+static struct kmem_cache *kernel_data_cache;
+static size_t kernel_data_size;
+
+static inline struct buffer_map *
+file_buffer_map(struct file *file)
 {
-	/* FIXME: Make atomic. */
-	return map_wrapper._uid_counter++;
+	return file->private_data;
 }
 
-struct map_entry {
-	struct rb_node node;
-	struct map_key key;
-	struct buffer_slab buffer;
-};
+/*
+ * Hand a buffer which has been removed from the map to its owner for cleanup
+ * and drop the map's reference. Must be called without any locks held.
+ */
+static void
+retire_buffer(struct buffer_slab *buffer)
+{
+	if (buffer->release)
+		buffer->release(buffer);
+	percpu_ref_kill(&buffer->ref);
+}
 
-/* A linked list of pointers to map enteries. */
-struct map_entry_list {
-	struct map_entry *entry;
-	struct list_head list;
-};
+/*
+ * Large rings are walked by the process and the workers alike, so try to back
+ * them with physically contiguous pages first. Fragmentation is expected
+ * though, don't try too hard before falling back to vmalloc.
+ */
+static int
+alloc_user_buffer(struct buffer_slab *buffer, size_t size, int node)
+{
+	buffer->user_buffer_size = PAGE_ALIGN(size);
+	buffer->user_pages = NULL;
+
+	if (size > PAGE_SIZE && get_order(size) < MAX_ORDER)
+		buffer->user_pages = alloc_pages_node(node, GFP_KERNEL | __GFP_COMP |
+				__GFP_ZERO | __GFP_NOWARN | __GFP_NORETRY,
+				get_order(size));
+
+	if (buffer->user_pages)
+		buffer->user_buffer = page_address(buffer->user_pages);
+	else
+		buffer->user_buffer = vzalloc_node(buffer->user_buffer_size, node);
+	return buffer->user_buffer != NULL;
+}
 
-struct file_ll_node {
-	struct map_key map_key;
-	struct list_head list;
-};
+static void
+free_user_buffer(struct buffer_slab *buffer)
+{
+	if (buffer->user_pages)
+		__free_pages(buffer->user_pages, get_order(buffer->user_buffer_size));
+	else
+		vfree(buffer->user_buffer);
+}
 
-struct file_ll_head {
-	struct spinlock spinlock;
-	struct list_head list;
-};
+static void
+free_kernel_data(struct rcu_head *rcu)
+{
+	kmem_cache_free(kernel_data_cache, container_of(rcu, struct kernel_data, buffer.rcu));
+}
 
-struct kernel_data {
-	struct map_entry map_entry;
-	struct file_ll_node file_ll_node;
-	char kernel_buffer[0]; // Variable length attr.
-};
+static void
+free_buffer_map(struct rcu_head *rcu)
+{
+	kmem_cache_free(buffer_map_cache, container_of(rcu, struct buffer_map, rcu));
+}
 
-static inline int
-map_key_cmp(struct map_key *l_key, struct map_key *r_key)
+static void
+free_buffer_work(struct work_struct *work)
 {
-	if (l_key->pid < r_key->pid)
-		return -1;
-	else if (l_key->pid > r_key->pid)
-		return 1;
-	else {
-		if (l_key->buffer_uid < r_key->buffer_uid)
-			return -1;
-		else if (l_key->buffer_uid > r_key->buffer_uid)
-			return 1;
-		else
-			return 0;
-	}
-};
+	struct buffer_slab *buffer = container_of(work, struct buffer_slab, free_work);
 
-/*
- * See linux/Documentation/rbtree.txt for original source.
- */
-static struct map_entry *
-map_search(struct rb_root *root, struct map_key *key)
+	if (buffer->destroy)
+		buffer->destroy(buffer);
+	free_user_buffer(buffer);
+	percpu_ref_exit(&buffer->ref);
+
+	/* A get_buffer() may still be looking at the ref, let it finish. */
+	call_rcu(&buffer->rcu, free_kernel_data);
+}
+
+static void
+buffer_ref_release(struct percpu_ref *ref)
 {
-	struct rb_node *node = root->rb_node;
-
-	/* Traverse the tree looking for our key */
-	while (node) {
-		struct map_entry *data = container_of(node, struct map_entry, node);
-		int result = map_key_cmp(key, &data->key);
-		if (result < 0)
-			node = node->rb_left;
-		else if (result > 0)
-			node = node->rb_right;
-		else
-			return data;
-	}
-	return NULL;
+	struct buffer_slab *buffer = container_of(ref, struct buffer_slab, ref);
+
+	queue_work(free_wq, &buffer->free_work);
 }
 
 /**
- * map_search_pid() - Search the map for all enteries with pid
- *
- * Return:		A linked list of them of all entries with a given pid.
- */
-//static struct map_entry_list *
-//map_search_pid(struct rb_root *root, pid_t pid)
-//{
-//	// TODO: This will be needed for deletion of an entire file's enteries.
-//	return NULL;
-//}
-
-/*
- * See linux/Documentation/rbtree.txt for original source.
+ * init_buffers() - Set up what allocating and freeing buffers needs
+ * @kernel_buffer_size	The most alloc_buffer() will be asked for
  */
-static int
-map_insert(struct rb_root *root, struct map_entry *data)
+int
+init_buffers(size_t kernel_buffer_size)
 {
-	struct rb_node **new = &(root->rb_node), *parent = NULL;
-
-	/* Figure out where to put new node */
-	while (*new) {
-		struct map_entry *this = container_of(*new, struct map_entry, node);
-		int result = map_key_cmp(&data->key, &this->key);
-
-		parent = *new;
-		if (result < 0)
-			new = &((*new)->rb_left);
-		else if (result > 0 )
-			new = &((*new)->rb_right);
-		else
-			return false;
-	}
+	kernel_data_size = kernel_buffer_size;
+	kernel_data_cache = kmem_cache_create("as_sys_kernel_data",
+			sizeof(struct kernel_data) + kernel_buffer_size,
+			__alignof__(struct kernel_data), SLAB_HWCACHE_ALIGN, NULL);
+	if (!kernel_data_cache)
+		return false;
 
-	/* Add new node and rebalance tree. */
-	rb_link_node(&data->node, parent, new);
-	rb_insert_color(&data->node, root);
+	if (!(buffer_map_cache = KMEM_CACHE(buffer_map, 0)))
+		goto fail_map_cache;
 
+	free_wq = alloc_workqueue("as_sys_free", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!free_wq)
+		goto fail_wq;
 	return true;
+
+fail_wq:
+	kmem_cache_destroy(buffer_map_cache);
+fail_map_cache:
+	kmem_cache_destroy(kernel_data_cache);
+	return false;
+}
+
+/* Every file is released by now, but their buffers may still be on the way out. */
+void
+deinit_buffers(void)
+{
+	destroy_workqueue(free_wq);
+	/* The caches have to be empty, so the RCU frees have to be done. */
+	rcu_barrier();
+	kmem_cache_destroy(buffer_map_cache);
+	kmem_cache_destroy(kernel_data_cache);
 }
 
 /**
  * alloc_buffer() - Allocate a buffer for a given file.
  * @size		Size of the buffer in bytes to allocate.
+ * @node		The node to allocate from, or NUMA_NO_NODE.
  * @file		The file context which we are going to
  *			attach the given buffer into.
  *
- * In order to maintain state information for processes the
- * file will use the file.private_data pointer to hold a unique
- * map key id for each buffer it holds. The format for this
- * list of map key ids for a file will be a singly linked list
- * to allow quick removal and additions.
- *
+ * The buffer takes an id in the file's map right away, but lookups only find
+ * it once publish_buffer() has been called. Until then it may still be freed
+ * with free_buffer().
  */
 int
-alloc_buffer(size_t user_buffer_size, size_t kernel_buffer_size,
+alloc_buffer(size_t user_buffer_size, size_t kernel_buffer_size, int node,
 		struct file *file, struct buffer_slab **buffer)
 {
-
+	struct buffer_map *map = file_buffer_map(file);
 	struct kernel_data *kernel_data;
+	unsigned int generation;
+	int id;
+
+	if (WARN_ON_ONCE(kernel_buffer_size > kernel_data_size))
+		return false;
 
 	/* Allocate space for the map entry*/
-	kernel_data = kmalloc(sizeof(struct kernel_data) + kernel_buffer_size, GFP_KERNEL);
-	if (!kernel_data) {
-		// TODO: Need to try a vmalloc if unable to succeed.
+	kernel_data = kmem_cache_alloc_node(kernel_data_cache, GFP_KERNEL, node);
+	if (!kernel_data)
 		return false; // Failed to alloc.
-	}
-	kernel_data->map_entry.buffer.kernel_buffer = &kernel_data->kernel_buffer;
+	kernel_data->buffer.kernel_buffer = &kernel_data->kernel_buffer;
 
-	/* Allocate space for our shared ring buffer. */
-	kernel_data->map_entry.buffer.user_buffer = kmalloc(user_buffer_size, GFP_USER);
-	if (!kernel_data->map_entry.buffer.user_buffer) {
-		// TODO: Need to try a vmalloc if unable to succeed.
-		kfree(kernel_data);
-		return false; // Failed to alloc.
-	}
 	/*
-	 * TODO: Need to set up the address space boundaries for the correct
-	 * process for the allocated buffer.
+	 * Allocate space for our shared ring buffer. It is zeroed and page
+	 * aligned so it may later be handed to the owning process with
+	 * map_user_buffer().
 	 */
+	if (!alloc_user_buffer(&kernel_data->buffer, user_buffer_size, node)) {
+		kmem_cache_free(kernel_data_cache, kernel_data);
+		return false; // Failed to alloc.
+	}
 
-	// Initilize the lock on the new map_entry's buffer and grab the lock.
-	rwlock_init(&kernel_data->map_entry.buffer.rwlock);
-	write_lock(&kernel_data->map_entry.buffer.rwlock);
-
-	read_lock(&file->f_owner.lock);
-	kernel_data->map_entry.key = (struct map_key){.buffer_uid = gen_next_map_id(), .pid = pid_nr(file->f_owner.pid)};
-
-	/* Grab the lock on this file's list of buffer entries. */
-	spin_lock(&((struct file_ll_head*)file->private_data)->spinlock);
-
-	write_lock(&map_wrapper.lock);
-	read_unlock(&file->f_owner.lock);
-	if (!map_insert(&map_wrapper._root, &kernel_data->map_entry)) {
-		// There was a duplicate....?
-		write_unlock(&map_wrapper.lock);
-		read_unlock(&file->f_owner.lock);
-
-		kfree(kernel_data->map_entry.buffer.user_buffer);
-		kfree(kernel_data);
+	/* The map owns the first reference, dropped when the buffer is freed. */
+	if (percpu_ref_init(&kernel_data->buffer.ref, buffer_ref_release, 0, GFP_KERNEL)) {
+		free_user_buffer(&kernel_data->buffer);
+		kmem_cache_free(kernel_data_cache, kernel_data);
 		return false;
 	}
-	*buffer = &kernel_data->map_entry.buffer;
-	write_unlock(&map_wrapper.lock);
+	INIT_WORK(&kernel_data->buffer.free_work, free_buffer_work);
+	kernel_data->buffer.release = NULL;
+	kernel_data->buffer.destroy = NULL;
 
-	/* With the node inserted into the tree we can now insert a tag into
-	 * the file's list of active buffers.
+	/*
+	 * Reserve the index with a NULL entry. Cycling through the indices
+	 * keeps a stale id from finding a new buffer straight away, the
+	 * generation tag in the id after the indices wrap around.
 	 */
-	list_add(&kernel_data->file_ll_node.list, &((struct file_ll_head*)file->private_data)->list);
-	spin_unlock(&((struct file_ll_head*)file->private_data)->spinlock);
+	idr_preload(GFP_KERNEL);
+	spin_lock(&map->lock);
+	id = idr_alloc_cyclic(&map->idr, NULL, 0, 1 << BUFFER_ID_INDEX_BITS, GFP_NOWAIT);
+	generation = map->generation++ & ((1U << BUFFER_ID_GEN_BITS) - 1);
+	spin_unlock(&map->lock);
+	idr_preload_end();
+	if (id < 0) {
+		percpu_ref_exit(&kernel_data->buffer.ref);
+		free_user_buffer(&kernel_data->buffer);
+		kmem_cache_free(kernel_data_cache, kernel_data);
+		return false;
+	}
 
+	kernel_data->buffer.id = (buffer_id_t)generation << BUFFER_ID_INDEX_BITS | id;
+	*buffer = &kernel_data->buffer;
 	return true;
 }
 
 /**
- * free_buffer() - Free the buffer of given id
+ * publish_buffer() - Make a buffer set up after alloc_buffer() visible
+ *
+ * Everything written to the buffer beforehand is seen by whoever finds it.
  */
 void
-free_buffer(buffer_id_t id, struct file *file)
+publish_buffer(struct buffer_slab *buffer, struct file *file)
 {
-	struct map_key map_key;
-	struct map_entry *match;
-	struct kernel_data *kernel_data;
+	struct buffer_map *map = file_buffer_map(file);
 
-	read_lock(&file->f_owner.lock);
-	map_key = (struct map_key){.buffer_uid = id, .pid = pid_nr(file->f_owner.pid)};
-	read_unlock(&file->f_owner.lock);
+	spin_lock(&map->lock);
+	/* idr_replace() orders the initialization before the store for us. */
+	idr_replace(&map->idr, buffer, BUFFER_ID_INDEX(buffer->id));
+	spin_unlock(&map->lock);
+}
 
-	write_lock(&map_wrapper.lock);
-	if (!(match = map_search(&map_wrapper._root, &map_key))) {
-		// No match found
-		write_unlock(&map_wrapper.lock);
+/**
+ * free_buffer() - Free the buffer of given id
+ */
+void
+free_buffer(buffer_id_t id, struct file *file)
+{
+	struct buffer_map *map = file_buffer_map(file);
+	struct buffer_slab *buffer;
+
+	spin_lock(&map->lock);
+	buffer = idr_find(&map->idr, BUFFER_ID_INDEX(id));
+	/* Whoever is still setting an unpublished buffer up owns its id. */
+	if (buffer && buffer->id == id)
+		idr_remove(&map->idr, BUFFER_ID_INDEX(id));
+	else
+		buffer = NULL;
+	spin_unlock(&map->lock);
+
+	if (!buffer) {
 		mpr_err("Called free_buffer for id '%lu' but no match found.", id);
 		return;
 	}
+	retire_buffer(buffer);
+}
 
-	kernel_data = container_of(match, struct kernel_data, map_entry);
-	spin_lock(&((struct file_ll_head*)file->private_data)->spinlock);
-
-	/* Note: The following order matters! */
-	/* Grab lock and never free since we free it */
-	write_lock(&match->buffer.rwlock);
+/**
+ * map_user_buffer() - Map part of a buffer's user_buffer into a process
+ * @buffer		A buffer pinned by the caller
+ * @vma			The area being set up by the mmap(2) call
+ * @offset		Page aligned offset into the user_buffer to map from
+ * @size		Number of bytes past @offset the caller may map
+ *
+ * The kernel and the process then share the same pages, so neither side has
+ * to copy what the other has placed in the buffer. The pages take a reference
+ * for each mapping, so they outlive the buffer until the process unmaps them.
+ */
+int
+map_user_buffer(struct buffer_slab *buffer, struct vm_area_struct *vma,
+		size_t offset, size_t size)
+{
+	unsigned long addr;
+	struct page *page;
+	void *src;
+	int ret;
 
-	/* Remove the mapping from the tree. */
-	rb_erase(&match->node, &map_wrapper._root);
-	/* Remove this linked list node from the list. */
-	list_del(&kernel_data->file_ll_node.list);
-	/* We can now unlock the tree since there is no way to find the buffer */
-	write_unlock(&map_wrapper.lock);
-	spin_unlock(&((struct file_ll_head*)file->private_data)->spinlock);
+	if (!PAGE_ALIGNED(offset) || offset + size > buffer->user_buffer_size)
+		return -EINVAL;
+	if (vma->vm_end - vma->vm_start > PAGE_ALIGN(size))
+		return -EINVAL;
 
-	kfree(match->buffer.user_buffer);
-	kfree(kernel_data);
+	/*
+	 * Insert page by page, each takes a reference of its own. The vmalloc
+	 * backed buffers come from vzalloc_node() rather than vmalloc_user(),
+	 * so remap_vmalloc_range() would refuse them.
+	 */
+	src = buffer->user_buffer + offset;
+	for (addr = vma->vm_start; addr < vma->vm_end; addr += PAGE_SIZE) {
+		if (buffer->user_pages)
+			page = virt_to_page(src);
+		else
+			page = vmalloc_to_page(src);
+		ret = vm_insert_page(vma, addr, page);
+		if (ret)
+			return ret;
+		src += PAGE_SIZE;
+	}
+	return 0;
 }
 
-/* Get the buffer from the map. */
+/**
+ * get_buffer() - Look up a buffer of the file and take a reference on it
+ *
+ * Only reads shared state: the map under RCU, the ref per-cpu. A buffer being
+ * freed may still be found, but its ref is killed so the lookup fails, and
+ * its memory outlives our RCU read section.
+ */
 int
-get_buffer(buffer_id_t id, pid_t pid, struct buffer_slab **buffer) {
-	struct map_key map_key = (struct map_key){.buffer_uid = id, .pid = pid};
-	struct map_entry *match;
-
-	read_lock(&map_wrapper.lock);
-	if (!(match = map_search(&map_wrapper._root, &map_key))) {
-		// No match found
-		read_unlock(&map_wrapper.lock);
+get_buffer(struct file *file, buffer_id_t id, struct buffer_slab **buffer)
+{
+	struct buffer_slab *match;
+
+	if (id >> (BUFFER_ID_INDEX_BITS + BUFFER_ID_GEN_BITS))
 		return false;
-	}
-	*buffer = &match->buffer;
-	/* Hand-over-hand lock must be done. */
-	read_lock(&match->buffer.rwlock);
-	read_unlock(&map_wrapper.lock);
-	return true;
+
+	rcu_read_lock();
+	match = idr_find(&file_buffer_map(file)->idr, BUFFER_ID_INDEX(id));
+	/* An id of an earlier slab at the same index is stale. */
+	if (match && (match->id != id || !percpu_ref_tryget_live(&match->ref)))
+		match = NULL;
+	rcu_read_unlock();
+
+	*buffer = match;
+	return match != NULL;
 }
 
 int
 buffer_init_file(struct file *file)
 {
-	struct file_ll_head* new_ll;
-	void * volatile*private_data = &file->private_data;
+	struct buffer_map *map;
 
-	if (!(new_ll = kmalloc(sizeof(struct file_ll_head), GFP_KERNEL)))
+	if (!(map = kmem_cache_alloc(buffer_map_cache, GFP_KERNEL)))
 		return false;
 
-	INIT_LIST_HEAD(&new_ll->list);
-	spin_lock_init(&new_ll->spinlock);
-
-	/*
-	 * This must occur after the spin_lock_init hence the volatile decl
-	 * above.
-	 */
-	*private_data = new_ll;
+	spin_lock_init(&map->lock);
+	idr_init(&map->idr);
+	init_waitqueue_head(&map->poll_wait);
+	map->generation = 0;
+	file->private_data = map;
 	return true;
 }
 
 void
 buffer_free_file(struct file *file)
 {
-	struct kernel_data *kernel_data;
-	struct file_ll_node *cur_node, *next_node;
+	struct buffer_map *map = file_buffer_map(file);
+	struct buffer_slab *buffer;
+	int id;
 
-	/*
-	 * FIXME: Race condition if close is called twice. Could crash if try to
-	 * access private data with a double free. Fix would be some kind of
-	 * lock to prevent private_data from disappearing between this null
-	 * check and grabbing its spinlock.
-	 */
-	if (!file->private_data)
+	if (!map)
 		return;
 
-	spin_lock(&((struct file_ll_head*)file->private_data)->spinlock);
-	write_lock(&map_wrapper.lock);
-
 	/*
-	 * Iterate over the linked list of buffer entries associated with this
-	 * file deleting the enteries and then freeing their buffers.
+	 * The file is going away, so nobody can be looking buffers up or
+	 * adding them anymore: no need for the lock.
 	 */
-	list_for_each_entry_safe(cur_node,
-				 next_node,
-				 &((struct file_ll_head*)file->private_data)->list,
-				 list) {
-
-		kernel_data = container_of(cur_node, struct kernel_data, file_ll_node);
-		/* Grab the write lock for the ability to delete this buffer. */
-		write_lock(&kernel_data->map_entry.buffer.rwlock);
-		/* Remove the mapping from the tree. */
-		rb_erase(&kernel_data->map_entry.node, &map_wrapper._root);
-		/* Remove this linked list node from the list. */
-		list_del(&kernel_data->file_ll_node.list);
-		kfree(kernel_data->map_entry.buffer.user_buffer);
-		kfree(kernel_data);
+	idr_for_each_entry(&map->idr, buffer, id)
+		retire_buffer(buffer);
+
+	idr_destroy(&map->idr);
+	/* Buffers retired above may still be waking poll_wait, see buffer_file_wait(). */
+	call_rcu(&map->rcu, free_buffer_map);
+	file->private_data = NULL;
+}
+
+/**
+ * buffer_file_wait() - The waitqueue poll(2) on the file sleeps on
+ *
+ * Buffers may outlive their file, so after the buffer's release hook has run
+ * it must not be touched anymore. Until then the queue stays valid for the
+ * rest of an RCU read section it was looked at in.
+ */
+wait_queue_head_t *
+buffer_file_wait(struct file *file)
+{
+	return &file_buffer_map(file)->poll_wait;
+}
+
+/**
+ * buffer_any() - Check whether any of the file's live buffers match
+ * @match		Called on each with a reference held, must not sleep
+ */
+int
+buffer_any(struct file *file, int (*match)(struct buffer_slab *buffer))
+{
+	struct buffer_slab *buffer;
+	int id, found = false;
+
+	rcu_read_lock();
+	idr_for_each_entry(&file_buffer_map(file)->idr, buffer, id) {
+		if (!percpu_ref_tryget_live(&buffer->ref))
+			continue;
+		found = match(buffer);
+		put_buffer(buffer);
+		if (found)
+			break;
 	}
-	write_unlock(&map_wrapper.lock);
-	spin_unlock(&((struct file_ll_head*)file->private_data)->spinlock);
+	rcu_read_unlock();
+	return found;
 }
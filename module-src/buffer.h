@@ -8,33 +8,55 @@
 
 #include <linux/types.h>
 #include <linux/fs.h>
-#include <linux/rwlock.h>
-#include <linux/pid.h>
+#include <linux/percpu-refcount.h>
+#include <linux/workqueue.h>
+#include <linux/rcupdate.h>
+#include <linux/mm_types.h>
+#include <linux/wait.h>
 
 typedef unsigned long buffer_id_t;
 
-
-struct map_key {
-	/* Both make up the key, <pid, buffer_uid> -> buffer. */
-	pid_t pid;
-	buffer_id_t buffer_uid;
-};
+/*
+ * An id is the slab's index in its file's map, tagged above that with the
+ * generation the map was at when the slab was allocated. Once the slab is
+ * freed and its index handed out again, the stale id doesn't match the new
+ * slab's and lookups with it keep failing. Both fit in an mmap(2) offset, see
+ * AS_SYS_MMAP_PGOFF.
+ */
+#define BUFFER_ID_INDEX_BITS 24
+#define BUFFER_ID_GEN_BITS 16
+#define BUFFER_ID_INDEX(id) ((id) & ((1UL << BUFFER_ID_INDEX_BITS) - 1))
 
 struct buffer_slab {
-	/** 
-	 * This isn't a traditional rwlock, write is needed to delete this
-	 * buffer slab but read is used to be able read/modify the internals 
-	 * of the user_buffer and kernel_buffer.
-	 *
-	 * We solve the problem which could occur with a dynamically allocated
-	 * lock (We lock a freed lock thinking it's still valid) by using
-	 * hand-over-hand locking. The map_wrapper will act as a short time BFL
-	 * to block other readers from being able to get to this on deletion.
+	/**
+	 * Lookups pin the slab with get_buffer() and may then keep using it
+	 * (e.g. to sleep) until put_buffer(). The file's map holds the initial
+	 * reference until the slab is freed with free_buffer(), which kills
+	 * the ref so that lookups fail from then on. The memory is only freed
+	 * once the last reference is put, the slab itself an RCU grace period
+	 * after that.
+	 */
+	struct percpu_ref ref;
+	struct work_struct free_work;
+	struct rcu_head rcu;
+	/**
+	 * Called once the slab has been removed from the map and can no longer
+	 * be found, before the map's own reference is dropped. May sleep.
+	 */
+	void (*release)(struct buffer_slab *buffer);
+	/* Called when the last reference is put, just before freeing. */
+	void (*destroy)(struct buffer_slab *buffer);
+	/*
+	 * Shared with the owning process, see map_user_buffer(). Physically
+	 * contiguous compound pages when user_pages is set, vmalloc'ed
+	 * otherwise. Zeroed and page aligned either way.
 	 */
-	rwlock_t rwlock;
 	void *user_buffer;
+	size_t user_buffer_size;
+	struct page *user_pages;
 	void *kernel_buffer;
-	struct map_key key;
+	/* Index of the slab in its file's map and its generation tag. */
+	buffer_id_t id;
 };
 
 /* Initilize the file's private_data for use in this module. */
@@ -43,15 +65,49 @@ int buffer_init_file(struct file *file);
 /* Free all of the given file's buffers. */
 void buffer_free_file(struct file *file);
 
-/* Allocate a buffer for a given file. */
-int alloc_buffer(size_t user_buffer_size, size_t kernel_buffer_size, 
+/*
+ * Allocate a buffer for a given file from the memory of `node` (or anywhere
+ * with NUMA_NO_NODE). It can't be found by get_buffer() until the caller is
+ * done setting it up and calls publish_buffer().
+ */
+int alloc_buffer(size_t user_buffer_size, size_t kernel_buffer_size, int node,
 		struct file *file, struct buffer_slab **buffer);
+void publish_buffer(struct buffer_slab *buffer, struct file *file);
 
-/* Get the buffer from the map. */
-int get_buffer(buffer_id_t id, pid_t pid, struct buffer_slab **buffer);
+/* Look up one of the file's buffers and pin it, see put_buffer(). */
+int get_buffer(struct file *file, buffer_id_t id, struct buffer_slab **buffer);
 
 /* Free the buffer for the given id. */
 void free_buffer(buffer_id_t id, struct file *file);
 
+/* The file's waitqueue for poll(2), see buffer.c for how long it lives. */
+wait_queue_head_t *buffer_file_wait(struct file *file);
+
+/* Whether match() is true for any of the file's published buffers. */
+int buffer_any(struct file *file, int (*match)(struct buffer_slab *buffer));
+
+/* Map a page aligned region of the user_buffer into the calling process. */
+int map_user_buffer(struct buffer_slab *buffer, struct vm_area_struct *vma,
+		size_t offset, size_t size);
+
+/* Take another reference on a buffer the caller already holds one on. */
+static inline void hold_buffer(struct buffer_slab *buffer)
+{
+	percpu_ref_get(&buffer->ref);
+}
+
+/* Drop a reference taken by get_buffer() or hold_buffer(). */
+static inline void put_buffer(struct buffer_slab *buffer)
+{
+	percpu_ref_put(&buffer->ref);
+}
+
+/*
+ * Set up and tear down what allocating and freeing buffers needs, at module
+ * load/unload. kernel_buffer_size is the most alloc_buffer() is asked for.
+ */
+int init_buffers(size_t kernel_buffer_size);
+void deinit_buffers(void);
+
 
 #endif
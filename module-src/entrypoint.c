@@ -13,39 +13,26 @@
 #include <linux/syscalls.h>
 #include <linux/sched.h>
 #include <linux/device.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
 
 #include <asm/uaccess.h>
 
 #include <as_sys/ioctl.h>
 #include "async_queue.h"
 #include "ioctl_calls.h"
+#include "syscall.h"
+#include "worker.h"
 #include "common.h"
 
-static void *sys_call_table;
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
 static struct miscdevice sample_device;
-/* Wrap the given callback syscall with memory space fixings so syscall check for correct
- * address space passes.
- */
-// Doesn't seem necessary for syscalls that are in the kernel already.
-//static void wrap_syscall(void(*callback)(void)) {
-//
-//	/* src: http://www.linux-mag.com/id/651/ */
-//
-//	/* Save current fs and set it to valid address. */
-//	mm_segment_t fs = get_fs();
-//	set_fs(get_ds());
-//
-//	/* system calls can be invoked */
-//	callback();
-//
-//	/* Restore to return to user space */
-//	set_fs(fs);
-//}
 
 static int
 my_open(struct inode *i, struct file *f)
 {
-	mpr_info("Driver: open()\n");
 	//// Assert we've received a file pointer from the kernel.
 	if (!f) {
 		mpr_err("File pointer not given\n");
@@ -62,8 +49,6 @@ my_open(struct inode *i, struct file *f)
 	f->f_owner.pid = get_task_pid(current, PIDTYPE_PID);
 	write_unlock(&f->f_owner.lock);
 
-	mpr_info("\t\t open pid = %d\n", current->pid);
-
 	/* This is actual code I want to keep now..*/
 	if (f->private_data) {
 		mpr_info("Why is private_data init on new file?\n");
@@ -78,38 +63,12 @@ my_open(struct inode *i, struct file *f)
 
 static int
 my_close(struct inode *i, struct file *f) {
-	mpr_info("Driver: close()\n");
 	deinit_async_queue_file(f);
 	return 0;
 }
 
 static long
 my_ioctl(struct file *f, unsigned int cmd, unsigned long arg) {
-	/*
-	   unsigned long flags;
-
-	   read_lock_irqsave(&f->f_owner.lock, flags);
-	   if (!f->f_owner.pid) {
-	   mpr_info("Driver: ioctl called on file without pid owner set!!\n");
-	   read_unlock_irqrestore(&f->f_owner.lock, flags);
-	   return -1;
-	   }
-	   mpr_info("Driver: ioctl(%u, %lu)\n", cmd, arg);
-	   mpr_info("\t\t ioctl pid: %d\n", pid_nr(f->f_owner.pid));
-	   read_unlock_irqrestore(&f->f_owner.lock, flags);
-
-	// Call the argd'th syscall
-	mpr_info("sys_call_table: %p\n", sys_call_table);
-	void (**sys_call_addr)(void);
-	sys_call_addr = sys_call_table + arg * sizeof(void*);
-	mpr_info("sys_call_table entry address: %p\n", sys_call_addr);
-	mpr_info("sys_call address: %p\n", *sys_call_addr);
-
-	// Doesn't seem that the address space change is necessary.
-	//wrap_syscall(*sys_call_addr);
-	(*sys_call_addr)();
-	*/
-
 	// Ensure the magic header is intact.
 	if (_IOC_TYPE(cmd) != AS_SYS_MAGIC) {
 		mpr_info("Invalid Magic Header provided.\n");
@@ -124,9 +83,28 @@ my_ioctl(struct file *f, unsigned int cmd, unsigned long arg) {
 		case AS_SYS_GETEVENTS:
 			return async_getevents((void*)arg, f);
 			break;
+		case AS_SYS_SUBMIT:
+			return async_submit((void*)arg, f);
+			break;
 		case AS_SYS_DESTROY:
 			return async_destroy(arg, f);
 			break;
+		case AS_SYS_NOTIFY:
+			return async_notify(arg, f);
+			break;
+		case AS_SYS_REGISTER_BUFFERS:
+		case AS_SYS_REGISTER_FILES:
+			return async_register(cmd, (void*)arg, f);
+			break;
+		case AS_SYS_REGISTER_EVENTFD:
+			return async_register_eventfd((void*)arg, f);
+			break;
+		case AS_SYS_STATS:
+			return async_stats((void*)arg, f);
+			break;
+		case AS_SYS_CANCEL:
+			return async_cancel((void*)arg, f);
+			break;
 		default:
 			mpr_info("Invalid ioctl command.\n");
 			mpr_info("\t\t cmd: 0x%x\n", cmd);
@@ -135,12 +113,26 @@ my_ioctl(struct file *f, unsigned int cmd, unsigned long arg) {
 	}
 }
 
+static int
+my_mmap(struct file *f, struct vm_area_struct *vma)
+{
+	return map_async_queue(f, vma);
+}
+
+static __poll_t
+my_poll(struct file *f, poll_table *wait)
+{
+	return poll_async_queues(f, wait);
+}
+
 // Use our simple above defined ops to fill this function pointer interface out.
 static struct file_operations fops = {
 	.owner = THIS_MODULE,
 	.open = my_open,
 	.release = my_close,
 	.unlocked_ioctl = my_ioctl,
+	.mmap = my_mmap,
+	.poll = my_poll,
 };
 
 static struct miscdevice sample_device= {
@@ -154,6 +146,21 @@ static struct miscdevice sample_device= {
 static int __init as_sys_init_module(void)
 {
 	int error;
+
+	if (!init_syscalls()) {
+		mpr_err("can't find the sys_call_table\n");
+		return -ENOENT;
+	}
+
+	if (!init_buffers(sizeof(struct queue_metadata)))
+		return -ENOMEM;
+
+	/* Workers need to be up before anyone can submit to them. */
+	if (!init_workers()) {
+		deinit_buffers();
+		return -ENOMEM;
+	}
+
 	/*
 	 * Create a special device so that people can use that device to
 	 * communicate with this module.
@@ -161,12 +168,11 @@ static int __init as_sys_init_module(void)
 
 	if ((error = misc_register(&sample_device))) {
 		mpr_err("can't misc_register :(\n");
+		deinit_workers();
+		deinit_buffers();
 		return error;
 	}
 
-	sys_call_table = (void*) kallsyms_lookup_name("sys_call_table");
-	mpr_info("sys_call_table addr: %p\n", sys_call_table);
-
 	sample_device.mode = S_IROTH | S_IWOTH;
 
 	mpr_info("Async-sys initilized\n");
@@ -180,6 +186,9 @@ static int __init as_sys_init_module(void)
 static void __exit as_sys_cleanup_module(void)
 {
 	misc_deregister(&sample_device);
+	deinit_workers();
+	/* The workers' last puts may still be freeing contexts. */
+	deinit_buffers();
 	mpr_info("Async-sys closing\n");
 }
 
@@ -7,12 +7,27 @@
 #include <linux/fs.h>
 #include <linux/uaccess.h>
 #include <linux/stddef.h>
+#include <linux/sched.h>
+#include <linux/time.h>
+#include <linux/jiffies.h>
+#include <linux/nodemask.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
 
 #include <as_sys/ioctl.h>
 #include "ioctl_calls.h"
 #include "async_queue.h"
+#include "worker.h"
+#include "sqpoll.h"
+#include "registered.h"
+#include "syscall.h"
+#include "stats.h"
+#include "trace.h"
 #include "common.h"
 
+/* Events reaped per copy out of GETEVENTS, bounded by what fits on the stack. */
+#define GETEVENTS_BATCH 16
+
 /**
  * async_setup() - Allocate a syscall buffer for the user
  * @nr_events:		The maximum number of system call events
@@ -20,53 +35,316 @@
  * @ctx_idp		A pointer to the request context that will be updated
  *			to hold context information.
  *
- *
+ * On success the sizes of the rings are written back so the caller can
+ * mmap(2) them, see AS_SYS_MMAP_PGOFF(), along with nr_events rounded up to
+ * the power of two the rings were made with. The rings count against the
+ * caller's RLIMIT_MEMLOCK.
  */
 int
 async_setup(void *user_argument, struct file *file_p)
 {
 	struct _async_setup setup_args;
 	async_context_t ctx_id;
+	unsigned long *allowed = NULL;
+	int ret;
 
 	if (!access_ok(VERIFY_READ, user_argument, sizeof(setup_args)))
-		return -1;
+		return -EFAULT;
 	if (copy_from_user(&setup_args, user_argument, sizeof(setup_args)))
-		return -1;
+		return -EFAULT;
 	if (!access_ok(VERIFY_WRITE, setup_args.ctx_idp, sizeof(*setup_args.ctx_idp)))
-		return -1;
-	if (setup_args.nr_events > MAX_NR)
-		return -1;
+		return -EFAULT;
+	if (!setup_args.nr_events ||
+	    setup_args.nr_events > min_t(unsigned int, max_nr_events, MAX_NR))
+		return -EINVAL;
+	if (setup_args.flags & ~(AS_SYS_SETUP_SQPOLL | AS_SYS_SETUP_RING_SPIN |
+				AS_SYS_SETUP_SQ_PER_CPU | AS_SYS_SETUP_NUMA_NODE |
+				AS_SYS_SETUP_ALLOWLIST | AS_SYS_SETUP_CQ_ADAPTIVE))
+		return -EINVAL;
+	if ((setup_args.flags & AS_SYS_SETUP_NUMA_NODE) &&
+	    (setup_args.numa_node < 0 || setup_args.numa_node >= nr_node_ids ||
+	     !node_online(setup_args.numa_node)))
+		return -EINVAL;
 
-	if (!init_async_queue(setup_args.nr_events, file_p, &ctx_id))
-		return -1;
+	if (setup_args.weight > AS_SYS_MAX_WEIGHT)
+		return -EINVAL;
+	/* Coalesced events have to be woken up for at some point. */
+	if (setup_args.cq_coalesce_nr > 1 &&
+	    (!setup_args.cq_coalesce_usecs ||
+	     setup_args.cq_coalesce_usecs > AS_SYS_MAX_CQ_COALESCE_USECS))
+		return -EINVAL;
+	if ((setup_args.flags & AS_SYS_SETUP_ALLOWLIST) &&
+	    (ret = alloc_allowlist((const __s32 __user *)setup_args.syscalls,
+				   setup_args.nr_syscalls, &allowed)))
+		return ret;
 
-	/* Copy out the async_context_t if it succeeded. */
-	if (copy_to_user(setup_args.ctx_idp, &ctx_id, sizeof(ctx_id)))
-		return -1;
-	else
+	/* On success the context owns the allowlist. */
+	if ((ret = init_async_queue(&setup_args, allowed, file_p, &ctx_id))) {
+		kfree(allowed);
+		return ret;
+	}
+
+	/* Copy out the async_context_t and ring sizes if it succeeded. */
+	if (copy_to_user(setup_args.ctx_idp, &ctx_id, sizeof(ctx_id)) ||
+	    copy_to_user(user_argument, &setup_args, sizeof(setup_args))) {
 		/* Copying failed, let's clean up the state we just made. */
 		deinit_async_queue(file_p, ctx_id);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+/*
+ * Check the reaping arguments GETEVENTS and SUBMIT share, turning timeout into
+ * jiffies (MAX_SCHEDULE_TIMEOUT if NULL). Without events max_nr is ignored,
+ * with them it may be no more than the queue's ring holds, which also keeps
+ * the size of events from overflowing.
+ */
+static int
+check_reap_args(struct buffer_slab *queue, long min_nr, long max_nr,
+		struct async_event __user *events, const struct timespec __user *timeout,
+		long *timeout_jiffies)
+{
+	struct timespec ts;
+
+	if (min_nr < 0)
+		return -EINVAL;
+	if (events && (max_nr < 0 || min_nr > max_nr ||
+		       max_nr > to_queue_metadata(queue)->nr_events))
+		return -EINVAL;
+	if (events && !access_ok(VERIFY_WRITE, events, max_nr * sizeof(*events)))
+		return -EFAULT;
 
+	*timeout_jiffies = MAX_SCHEDULE_TIMEOUT;
+	if (timeout) {
+		if (copy_from_user(&ts, timeout, sizeof(ts)))
+			return -EFAULT;
+		if (!timespec_valid(&ts))
+			return -EINVAL;
+		*timeout_jiffies = timespec_to_jiffies(&ts);
+	}
 	return 0;
 }
 
+/*
+ * Wait for min_nr events and copy out up to max_nr, with the arguments checked
+ * by check_reap_args(). Returns how many were copied out, or without
+ * user_events how many are waiting on the ring for the process to reap.
+ */
+static long
+reap_events(struct buffer_slab *queue, long min_nr, long max_nr,
+		struct async_event __user *user_events, long timeout_jiffies)
+{
+	struct async_event events[GETEVENTS_BATCH];
+	long ret, nr = 0;
+	size_t got;
+
+	/*
+	 * The process may have made room by reaping straight off the ring,
+	 * let submissions held back for it go before waiting on them.
+	 */
+	kick_workers(queue);
+
+	ret = wait_for_events(queue, min_nr, timeout_jiffies);
+	if (ret < 0 && ret != -ERESTARTSYS)
+		goto out;
+
+	if (!user_events) {
+		nr = events_queued(to_queue_metadata(queue));
+		ret = (ret == -ERESTARTSYS && !nr) ? -EINTR : nr;
+		goto out;
+	}
+
+	/*
+	 * Reap whatever is ready, even when interrupted, so the events we did
+	 * wait for aren't left behind.
+	 */
+	while (nr < max_nr) {
+		got = try_get_events(queue, events,
+				min_t(long, max_nr - nr, GETEVENTS_BATCH));
+		if (!got)
+			break;
+		if (copy_to_user(&user_events[nr], events, got * sizeof(*events))) {
+			/* The events are lost, just as if the ring was torn down. */
+			ret = -EFAULT;
+			goto out;
+		}
+		nr += got;
+	}
+
+	/* Only report the signal if it cost the caller every event. */
+	ret = (ret == -ERESTARTSYS && !nr) ? -EINTR : nr;
+
+	/* Room was made for events, submissions held back for it may go. */
+	if (nr)
+		kick_workers(queue);
+out:
+	trace_as_sys_wait(queue->id, min_nr, ret);
+	return ret;
+}
+
 /**
  * async_getevents() - Block until the number of events are serviced or timeout
  *			occurs
  * @ctx			The context number of the syscall queue
  * @min_nr		The minumum number of events to wait for
- * @max_nr		The maximum number of events to wait for
+ * @max_nr		The maximum number of events to copy out into @events, at
+ *			most the context's nr_events
+ * @events		User array of at least @max_nr events to fill in
+ * @timeout		How long to wait for @min_nr events, NULL to wait
+ *			forever
+ *
+ * Return:		The number of events copied out, which may be less than
+ *			@min_nr if the timeout expired. Without @events, the
+ *			number of events on the ring.
  */
 int
 async_getevents(void *user_argument, struct file *file_p)
 {
-	return -1; // TODO: UNSUPPORTED
+	struct _async_getevents getevents_args;
+	struct buffer_slab *queue;
+	long timeout_jiffies;
+	long ret;
 
-	//struct _async_getevents getevents_args;
-	//if (!access_ok(VERIFY_READ, user_argument, sizeof(getevents_args)))
-	//	return -1;
-	//if (copy_from_user(&getevents_args, user_argument, sizeof(getevents_args)))
-	//	return -1;
+	if (!access_ok(VERIFY_READ, user_argument, sizeof(getevents_args)))
+		return -EFAULT;
+	if (copy_from_user(&getevents_args, user_argument, sizeof(getevents_args)))
+		return -EFAULT;
+	if (!get_async_queue(file_p, getevents_args.ctx, &queue))
+		return -EINVAL;
+
+	if (!(ret = check_reap_args(queue, getevents_args.min_nr, getevents_args.max_nr,
+				getevents_args.events, getevents_args.timeout,
+				&timeout_jiffies)))
+		ret = reap_events(queue, getevents_args.min_nr, getevents_args.max_nr,
+				getevents_args.events, timeout_jiffies);
+	put_async_queue(queue);
+	return ret;
+}
+
+/* Push the n cbs, done counting the ones pushed. False if not all of them were. */
+static bool
+push_calls(struct buffer_slab *queue, struct async_cb *cbs, size_t n, long *done)
+{
+	size_t pushed;
+
+	if (!n)
+		return true;
+	pushed = submit_calls(queue, cbs, n);
+	*done += pushed;
+	return pushed == n;
+}
+
+/* Whether cbs[i] may be run by try_run_inline(), it's no part of a chain. */
+static inline bool
+inline_call(const struct async_cb *cbs, size_t i)
+{
+	return (cbs[i].flags & AS_SYS_CB_INLINE) && !(cbs[i].flags & AS_SYS_CB_LINK) &&
+		!(i && (cbs[i - 1].flags & AS_SYS_CB_LINK));
+}
+
+/**
+ * async_submit() - Push submissions from the process' memory, maybe wait
+ *
+ * For processes which can't map the rings, see struct _async_submit. The
+ * array of cb pointers is copied in at once, then the cbs it points to, and
+ * all of them are pushed with a single insert. At most a ring's worth is
+ * taken per call. A chain goes on whole or not at all, the last cb of the
+ * array ends any chain.
+ *
+ * AS_SYS_CB_INLINE calls outside of chains are tried right here instead, see
+ * try_run_inline(). Whatever comes before one is pushed first, so the cbs
+ * taken care of are always the first ones of the array.
+ *
+ * Return:		How many submissions were pushed or run, -EAGAIN if the
+ *			ring had no room for any.
+ */
+int
+async_submit(void *user_argument, struct file *file_p)
+{
+	struct _async_submit submit_args;
+	struct async_cb __user **cbps = NULL;
+	struct async_cb *cbs = NULL;
+	struct buffer_slab *queue;
+	long timeout_jiffies = 0;
+	long done = 0;
+	size_t nr, i, start;
+	int ret;
+
+	if (copy_from_user(&submit_args, user_argument, sizeof(submit_args)))
+		return -EFAULT;
+	if (submit_args.nr < 0)
+		return -EINVAL;
+	if (!get_async_queue(file_p, submit_args.ctx, &queue))
+		return -EINVAL;
+	if (submit_args.max_nr &&
+	    (ret = check_reap_args(queue, submit_args.min_nr, submit_args.max_nr,
+				submit_args.events, submit_args.timeout,
+				&timeout_jiffies))) {
+		put_async_queue(queue);
+		return ret;
+	}
+
+	ret = 0;
+	/* More than the ring holds can't be pushed anyway. */
+	nr = min_t(size_t, submit_args.nr, to_queue_metadata(queue)->nr_events);
+	if (nr && (!(cbps = kvmalloc_array(nr, sizeof(*cbps), GFP_KERNEL)) ||
+		   !(cbs = kvmalloc_array(nr, sizeof(*cbs), GFP_KERNEL)))) {
+		ret = -ENOMEM;
+		nr = 0;
+	} else if (copy_from_user(cbps, submit_args.cbs, nr * sizeof(*cbps))) {
+		ret = -EFAULT;
+		nr = 0;
+	}
+	for (i = 0; i < nr; i++) {
+		if (copy_from_user(&cbs[i], cbps[i], sizeof(*cbs))) {
+			/* What comes before still goes, less an unfinished chain. */
+			ret = -EFAULT;
+			nr = i;
+			break;
+		}
+	}
+	if (nr && nr == submit_args.nr)
+		cbs[nr - 1].flags &= ~AS_SYS_CB_LINK;
+
+	for (i = start = 0; i < nr; i++) {
+		if (!inline_call(cbs, i))
+			continue;
+		if (!push_calls(queue, cbs + start, i - start, &done))
+			break;
+		start = i;
+		if (try_run_inline(queue, &cbs[i])) {
+			done++;
+			start = i + 1;
+		}
+	}
+	if (i == nr)
+		push_calls(queue, cbs + start, nr - start, &done);
+	kvfree(cbs);
+	kvfree(cbps);
+
+	if (done) {
+		if (trace_as_sys_submit_enabled())
+			trace_as_sys_submit(queue->id, submissions_queued(to_queue_metadata(queue)));
+		wake_sqpoll(queue);
+		kick_workers(queue);
+	}
+
+	if (submit_args.max_nr) {
+		submit_args.nr_reaped = reap_events(queue, submit_args.min_nr,
+				submit_args.max_nr, submit_args.events, timeout_jiffies);
+		if (put_user(submit_args.nr_reaped,
+			     &((struct _async_submit __user *)user_argument)->nr_reaped) &&
+		    !ret)
+			ret = -EFAULT;
+	}
+	put_async_queue(queue);
+
+	/* Like write(2), what was taken counts for more than a later fault. */
+	if (done || !submit_args.nr)
+		return done;
+	return ret ? ret : -EAGAIN;
 }
 
 /**
@@ -80,3 +358,117 @@ async_destroy(unsigned long user_argument, struct file *file_p)
 
 	return 0;
 }
+
+/**
+ * async_notify() - Hand the context's newly pushed submissions to the workers
+ *
+ * Only needed once the workers have set AS_SYS_SQ_WORKERS_IDLE or, with
+ * AS_SYS_SETUP_SQPOLL, the poller AS_SYS_SQ_NEED_WAKEUP, it is woken back up.
+ */
+int
+async_notify(unsigned long user_argument, struct file *file_p)
+{
+	struct buffer_slab *queue;
+
+	if (!get_async_queue(file_p, (async_context_t)user_argument, &queue))
+		return -EINVAL;
+
+	if (trace_as_sys_submit_enabled())
+		trace_as_sys_submit(queue->id, submissions_queued(to_queue_metadata(queue)));
+	wake_sqpoll(queue);
+	kick_workers(queue);
+	put_async_queue(queue);
+	return 0;
+}
+
+/**
+ * async_register() - Register buffers or files with a context
+ * @cmd			AS_SYS_REGISTER_BUFFERS or AS_SYS_REGISTER_FILES
+ *
+ * See struct _async_register, the AS_SYS_*_FIXED calls then refer to them by
+ * their index in the array passed.
+ */
+int
+async_register(unsigned int cmd, void *user_argument, struct file *file_p)
+{
+	struct _async_register reg;
+	struct buffer_slab *queue;
+	int ret;
+
+	if (copy_from_user(&reg, user_argument, sizeof(reg)))
+		return -EFAULT;
+	if (!get_async_queue(file_p, reg.ctx, &queue))
+		return -EINVAL;
+
+	if (cmd == AS_SYS_REGISTER_BUFFERS)
+		ret = register_buffers(queue, (const struct iovec __user *)reg.data, reg.nr);
+	else
+		ret = register_files(queue, (const int __user *)reg.data, reg.nr, file_p);
+
+	put_async_queue(queue);
+	return ret;
+}
+
+/**
+ * async_register_eventfd() - Have a context's completions signal an eventfd
+ *
+ * See struct _async_eventfd and AS_SYS_CQ_EVENTFD_SIGNALED.
+ */
+int
+async_register_eventfd(void *user_argument, struct file *file_p)
+{
+	struct _async_eventfd reg;
+	struct buffer_slab *queue;
+	int ret;
+
+	if (copy_from_user(&reg, user_argument, sizeof(reg)))
+		return -EFAULT;
+	if (!get_async_queue(file_p, reg.ctx, &queue))
+		return -EINVAL;
+
+	ret = register_eventfd(queue, reg.fd);
+	put_async_queue(queue);
+	return ret;
+}
+
+/**
+ * async_stats() - Copy out a context's counters, see struct _async_stats
+ */
+int
+async_stats(void *user_argument, struct file *file_p)
+{
+	struct _async_stats stats;
+	struct buffer_slab *queue;
+
+	if (copy_from_user(&stats.ctx, user_argument, sizeof(stats.ctx)))
+		return -EFAULT;
+	if (!get_async_queue(file_p, stats.ctx, &queue))
+		return -EINVAL;
+
+	read_queue_stats(queue, &stats);
+	put_async_queue(queue);
+
+	if (copy_to_user(user_argument, &stats, sizeof(stats)))
+		return -EFAULT;
+	return 0;
+}
+
+/**
+ * async_cancel() - Cancel a submitted call, see struct _async_cancel
+ */
+int
+async_cancel(void *user_argument, struct file *file_p)
+{
+	struct _async_cancel cancel;
+	struct buffer_slab *queue;
+	int ret;
+
+	if (copy_from_user(&cancel, user_argument, sizeof(cancel)))
+		return -EFAULT;
+	if (!get_async_queue(file_p, cancel.ctx, &queue))
+		return -EINVAL;
+
+	ret = cancel_submission(queue, cancel.user_data);
+	put_async_queue(queue);
+	return ret;
+}
@@ -12,6 +12,18 @@ int async_setup(void *user_argument, struct file *file_p);
 
 int async_getevents(void *user_argument, struct file *file_p);
 
+int async_submit(void *user_argument, struct file *file_p);
+
 int async_destroy(unsigned long, struct file *file_p);
 
+int async_notify(unsigned long, struct file *file_p);
+
+int async_register(unsigned int cmd, void *user_argument, struct file *file_p);
+
+int async_register_eventfd(void *user_argument, struct file *file_p);
+
+int async_stats(void *user_argument, struct file *file_p);
+
+int async_cancel(void *user_argument, struct file *file_p);
+
 #endif
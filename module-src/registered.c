@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2017 Sean Wilson <spwilson2@wisc.edu>
+ *
+ * This file is released under the GPLv2
+ */
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/sizes.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/eventfd.h>
+
+#include <as_sys/ioctl.h>
+#include "async_queue.h"
+#include "registered.h"
+#include "common.h"
+
+/*
+ * A pinned buffer is also mapped into the kernel in one piece, so the workers
+ * copy through `addr` rather than the process' address: neither a page fault
+ * nor an munmap(2) of the process can get in between.
+ */
+struct registered_buffer {
+	void *addr;
+	size_t len;
+	void *map;
+	unsigned int nr_pages;
+	struct page **pages;
+};
+
+struct registered_buffers {
+	unsigned int nr;
+	/* The pinned pages are charged to RLIMIT_MEMLOCK like the rings. */
+	struct user_struct *user;
+	unsigned long locked_pages;
+	struct registered_buffer bufs[];
+};
+
+struct registered_files {
+	unsigned int nr;
+	struct file *files[];
+};
+
+static void
+unpin_buffer(struct registered_buffer *buf)
+{
+	unsigned int i;
+
+	vunmap(buf->map);
+	/* The workers may have written to them behind the page tables' back. */
+	for (i = 0; i < buf->nr_pages; i++) {
+		set_page_dirty_lock(buf->pages[i]);
+		put_page(buf->pages[i]);
+	}
+	kvfree(buf->pages);
+}
+
+static int
+pin_buffer(struct registered_buffer *buf, const struct iovec *iov)
+{
+	unsigned long start = (unsigned long)iov->iov_base;
+	int pinned;
+
+	if (!iov->iov_len || iov->iov_len > SZ_1G || start + iov->iov_len < start)
+		return -EINVAL;
+
+	buf->nr_pages = ((start + iov->iov_len - 1) >> PAGE_SHIFT) -
+		(start >> PAGE_SHIFT) + 1;
+	buf->pages = kvmalloc_array(buf->nr_pages, sizeof(*buf->pages), GFP_KERNEL);
+	if (!buf->pages)
+		return -ENOMEM;
+
+	/* Pin them writable, reads fill them in. */
+	pinned = get_user_pages_fast(start & PAGE_MASK, buf->nr_pages, 1, buf->pages);
+	if (pinned != buf->nr_pages) {
+		while (pinned > 0)
+			put_page(buf->pages[--pinned]);
+		kvfree(buf->pages);
+		return pinned < 0 ? pinned : -EFAULT;
+	}
+
+	buf->map = vmap(buf->pages, buf->nr_pages, VM_MAP, PAGE_KERNEL);
+	if (!buf->map) {
+		for (pinned = 0; pinned < buf->nr_pages; pinned++)
+			put_page(buf->pages[pinned]);
+		kvfree(buf->pages);
+		return -ENOMEM;
+	}
+	buf->addr = buf->map + offset_in_page(start);
+	buf->len = iov->iov_len;
+	return 0;
+}
+
+static void
+free_buffers(struct registered_buffers *bufs)
+{
+	unsigned int i;
+
+	for (i = 0; i < bufs->nr; i++)
+		unpin_buffer(&bufs->bufs[i]);
+	unaccount_locked_pages(bufs->user, bufs->locked_pages);
+	kvfree(bufs);
+}
+
+static void
+free_files(struct registered_files *files)
+{
+	unsigned int i;
+
+	for (i = 0; i < files->nr; i++)
+		fput(files->files[i]);
+	kvfree(files);
+}
+
+/**
+ * register_buffers() - Pin the buffers the context's fixed calls may refer to
+ * @queue		The context, pinned by the caller
+ * @iovecs		User array of the buffers
+ * @nr			Number of buffers, at most AS_SYS_MAX_REGISTERED
+ *
+ * Only once per context. The set is published whole, so workers never see it
+ * half built and never need a lock to use it.
+ */
+int
+register_buffers(struct buffer_slab *queue, const struct iovec __user *iovecs,
+		unsigned int nr)
+{
+	struct queue_metadata *queue_metadata = to_queue_metadata(queue);
+	struct registered_buffers *bufs;
+	struct iovec iov;
+	unsigned long total_pages = 0;
+	unsigned int i;
+	int ret;
+
+	if (!nr || nr > AS_SYS_MAX_REGISTERED)
+		return -EINVAL;
+	/* The process the workers run as is the one whose pages these are. */
+	if (current->mm != queue_metadata->mm)
+		return -EINVAL;
+	if (READ_ONCE(queue_metadata->registered_buffers))
+		return -EBUSY;
+
+	bufs = kvzalloc(sizeof(*bufs) + nr * sizeof(bufs->bufs[0]), GFP_KERNEL);
+	if (!bufs)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		if (copy_from_user(&iov, &iovecs[i], sizeof(iov))) {
+			ret = -EFAULT;
+			goto fail;
+		}
+		if ((ret = pin_buffer(&bufs->bufs[i], &iov)))
+			goto fail;
+		bufs->nr++;
+		total_pages += bufs->bufs[i].nr_pages;
+	}
+
+	if (!account_locked_pages(total_pages, &bufs->user)) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	bufs->locked_pages = total_pages;
+
+	if (cmpxchg(&queue_metadata->registered_buffers, NULL, bufs)) {
+		ret = -EBUSY;
+		goto fail;
+	}
+	return 0;
+
+fail:
+	free_buffers(bufs);
+	return ret;
+}
+
+/**
+ * register_files() - Take the files the context's fixed calls may refer to
+ * @queue		The context, pinned by the caller
+ * @fds			User array of the file descriptors
+ * @nr			Number of fds, at most AS_SYS_MAX_REGISTERED
+ * @own_file		The device file the ioctl came in on
+ *
+ * Only once per context, see register_buffers(). The context would keep an
+ * as_sys file registered with it from ever being released, and so itself
+ * from being freed, so those are refused.
+ */
+int
+register_files(struct buffer_slab *queue, const int __user *fds,
+		unsigned int nr, struct file *own_file)
+{
+	struct queue_metadata *queue_metadata = to_queue_metadata(queue);
+	struct registered_files *files;
+	struct file *file;
+	unsigned int i;
+	int fd, ret;
+
+	if (!nr || nr > AS_SYS_MAX_REGISTERED)
+		return -EINVAL;
+	if (READ_ONCE(queue_metadata->registered_files))
+		return -EBUSY;
+
+	files = kvzalloc(sizeof(*files) + nr * sizeof(files->files[0]), GFP_KERNEL);
+	if (!files)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		if (get_user(fd, &fds[i])) {
+			ret = -EFAULT;
+			goto fail;
+		}
+		if (!(file = fget(fd))) {
+			ret = -EBADF;
+			goto fail;
+		}
+		if (file->f_op == own_file->f_op) {
+			fput(file);
+			ret = -EBADF;
+			goto fail;
+		}
+		files->files[files->nr++] = file;
+	}
+
+	if (cmpxchg(&queue_metadata->registered_files, NULL, files)) {
+		ret = -EBUSY;
+		goto fail;
+	}
+	return 0;
+
+fail:
+	free_files(files);
+	return ret;
+}
+
+/**
+ * register_eventfd() - Have the context's completions signal an eventfd
+ * @queue		The context, pinned by the caller
+ * @fd			The eventfd, in the calling process
+ *
+ * Only once per context. The eventfd is signaled once for however many
+ * events are posted until the process clears AS_SYS_CQ_EVENTFD_SIGNALED.
+ */
+int
+register_eventfd(struct buffer_slab *queue, int fd)
+{
+	struct queue_metadata *queue_metadata = to_queue_metadata(queue);
+	struct eventfd_ctx *eventfd;
+
+	if (READ_ONCE(queue_metadata->eventfd))
+		return -EBUSY;
+
+	eventfd = eventfd_ctx_fdget(fd);
+	if (IS_ERR(eventfd))
+		return PTR_ERR(eventfd);
+
+	if (cmpxchg(&queue_metadata->eventfd, NULL, eventfd)) {
+		eventfd_ctx_put(eventfd);
+		return -EBUSY;
+	}
+	return 0;
+}
+
+void
+unregister_all(struct queue_metadata *queue_metadata)
+{
+	if (queue_metadata->registered_buffers)
+		free_buffers(queue_metadata->registered_buffers);
+	if (queue_metadata->registered_files)
+		free_files(queue_metadata->registered_files);
+	if (queue_metadata->eventfd)
+		eventfd_ctx_put(queue_metadata->eventfd);
+	queue_metadata->registered_buffers = NULL;
+	queue_metadata->registered_files = NULL;
+	queue_metadata->eventfd = NULL;
+}
+
+static ssize_t
+fixed_rw(struct file *file, long number, void *addr, size_t len, loff_t *pos)
+{
+	if (number == AS_SYS_READ_FIXED)
+		return kernel_read(file, addr, len, pos);
+	return kernel_write(file, addr, len, pos);
+}
+
+/**
+ * do_fixed_op() - Run an AS_SYS_READ_FIXED or AS_SYS_WRITE_FIXED call
+ * @queue_metadata	The context the call was submitted to
+ * @number		Which of the two
+ * @args		The call's arguments
+ *
+ * Return:		What read(2) or write(2) would have, -EBADF or -EFAULT
+ *			for an index or range outside of what was registered.
+ */
+long
+do_fixed_op(struct queue_metadata *queue_metadata, long number,
+		const __u64 args[AS_SYS_MAX_ARGS])
+{
+	struct registered_files *files = smp_load_acquire(&queue_metadata->registered_files);
+	struct registered_buffers *bufs = smp_load_acquire(&queue_metadata->registered_buffers);
+	unsigned long offset = args[2], len = args[3];
+	loff_t pos = (loff_t)args[4];
+	struct registered_buffer *buf;
+	struct file *file;
+	ssize_t ret;
+
+	if (!files || args[0] >= files->nr)
+		return -EBADF;
+	if (!bufs || args[1] >= bufs->nr)
+		return -EFAULT;
+	file = files->files[args[0]];
+	buf = &bufs->bufs[args[1]];
+	if (offset > buf->len || len > buf->len - offset)
+		return -EFAULT;
+
+	if (pos != -1)
+		return fixed_rw(file, number, buf->addr + offset, len, &pos);
+
+	/* As fdget_pos() would, for the file's own position. */
+	mutex_lock(&file->f_pos_lock);
+	pos = file->f_pos;
+	ret = fixed_rw(file, number, buf->addr + offset, len, &pos);
+	if (ret >= 0)
+		file->f_pos = pos;
+	mutex_unlock(&file->f_pos_lock);
+	return ret;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2017 Sean Wilson <spwilson2@wisc.edu>
+ *
+ * This file is released under the GPLv2
+ */
+
+#ifndef __MODULE_SRC_REGISTERED_H
+#define __MODULE_SRC_REGISTERED_H
+
+#include <linux/fs.h>
+#include <linux/uio.h>
+
+#include <as_sys/ioctl.h>
+#include "buffer.h"
+
+struct queue_metadata;
+
+/*
+ * Pin the calling process' buffers for the context, see AS_SYS_READ_FIXED.
+ * Returns 0 or a negative errno for the ioctl to hand back.
+ */
+int register_buffers(struct buffer_slab *queue, const struct iovec __user *iovecs,
+		unsigned int nr);
+
+/*
+ * Take references on the calling process' files for the context. Files of
+ * @own_file's kind are refused, the context can't hold on to its own device.
+ */
+int register_files(struct buffer_slab *queue, const int __user *fds,
+		unsigned int nr, struct file *own_file);
+
+/* Signal the eventfd @fd as the context's events are posted. */
+int register_eventfd(struct buffer_slab *queue, int fd);
+
+/* Drop everything registered, once no worker can be using it anymore. */
+void unregister_all(struct queue_metadata *queue_metadata);
+
+static inline int
+is_fixed_op(long number)
+{
+	return number == AS_SYS_READ_FIXED || number == AS_SYS_WRITE_FIXED;
+}
+
+/* Run one of the AS_SYS_*_FIXED calls, as the submitter. */
+long do_fixed_op(struct queue_metadata *queue_metadata, long number,
+		const __u64 args[AS_SYS_MAX_ARGS]);
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2017 Sean Wilson <spwilson2@wisc.edu>
+ *
+ * This file is released under the GPLv2
+ */
+
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/jiffies.h>
+#include <linux/wait.h>
+#include <linux/cpumask.h>
+#include <linux/topology.h>
+#include <linux/err.h>
+#include <linux/capability.h>
+
+#include <as_sys/ioctl.h>
+#include "async_queue.h"
+#include "worker.h"
+#include "sqpoll.h"
+#include "shared_libs/asm_primitives.h"
+#include "common.h"
+
+#define DEFAULT_IDLE_MS 1000
+
+/*
+ * Sleeping has to be announced through the ring before checking it a final
+ * time. A submitter pushes before it checks the flag, so either we see its
+ * submission or it sees the flag and wakes us.
+ */
+static void
+sqpoll_sleep(struct queue_metadata *queue_metadata)
+{
+	circle_buffer *syscall_queue = queue_metadata->syscall_queue;
+
+	__sync_fetch_and_or(&syscall_queue->flags, AS_SYS_SQ_NEED_WAKEUP);
+	smp_mb();
+
+	wait_event_interruptible(queue_metadata->sqpoll_wait,
+			kthread_should_stop() || submissions_pending(queue_metadata));
+
+	__sync_fetch_and_and(&syscall_queue->flags, ~AS_SYS_SQ_NEED_WAKEUP);
+}
+
+/*
+ * Spin on the submission rings handing anything which shows up to the workers,
+ * once it has been empty for sqpoll_idle we go to sleep until notified.
+ */
+static int
+sqpoll_fn(void *data)
+{
+	struct buffer_slab *queue = data;
+	struct queue_metadata *queue_metadata = to_queue_metadata(queue);
+	unsigned long idle_until = jiffies + queue_metadata->sqpoll_idle;
+
+	while (!kthread_should_stop()) {
+		if (submissions_pending(queue_metadata)) {
+			kick_workers(queue);
+			idle_until = jiffies + queue_metadata->sqpoll_idle;
+		} else if (time_after(jiffies, idle_until)) {
+			sqpoll_sleep(queue_metadata);
+			idle_until = jiffies + queue_metadata->sqpoll_idle;
+			continue;
+		}
+
+		if (need_resched())
+			cond_resched();
+		else
+			__asm_pause();
+	}
+	return 0;
+}
+
+/**
+ * start_sqpoll() - Give the context a thread polling its submission ring
+ * @queue		A context which has just been set up
+ * @setup		The setup request asking for AS_SYS_SETUP_SQPOLL
+ *
+ * The thread only needs to be stopped with stop_sqpoll() before the context
+ * is freed, it doesn't hold a reference to it.
+ *
+ * A poller takes a cpu (one of the caller's choosing with sq_thread_cpu) for
+ * as long as sq_thread_idle says, anyone could open the device and take them
+ * all. So it is for CAP_SYS_NICE only, as running at a higher priority is.
+ *
+ * Return:		0, -EPERM without CAP_SYS_NICE, -EINVAL for a cpu which
+ *			isn't online or the error starting the thread.
+ */
+int
+start_sqpoll(struct buffer_slab *queue, struct _async_setup *setup)
+{
+	struct queue_metadata *queue_metadata = to_queue_metadata(queue);
+	struct task_struct *thread;
+
+	if (!capable(CAP_SYS_NICE))
+		return -EPERM;
+	if (setup->sq_thread_cpu >= 0 &&
+	    (setup->sq_thread_cpu >= nr_cpu_ids || !cpu_online(setup->sq_thread_cpu)))
+		return -EINVAL;
+
+	init_waitqueue_head(&queue_metadata->sqpoll_wait);
+	queue_metadata->sqpoll_idle = msecs_to_jiffies(setup->sq_thread_idle ?
+			setup->sq_thread_idle : DEFAULT_IDLE_MS);
+
+	thread = kthread_create_on_node(sqpoll_fn, queue, queue_metadata->numa_node,
+			"as_sys_sqpoll/%lu", queue->id);
+	if (IS_ERR(thread))
+		return PTR_ERR(thread);
+	/* Unless told otherwise, keep to the node of the rings. */
+	if (setup->sq_thread_cpu >= 0)
+		kthread_bind(thread, setup->sq_thread_cpu);
+	else
+		set_cpus_allowed_ptr(thread, cpumask_of_node(queue_metadata->numa_node));
+
+	queue_metadata->sqpoll = thread;
+	wake_up_process(thread);
+	return 0;
+}
+
+void
+stop_sqpoll(struct buffer_slab *queue)
+{
+	struct queue_metadata *queue_metadata = to_queue_metadata(queue);
+
+	if (!queue_metadata->sqpoll)
+		return;
+
+	kthread_stop(queue_metadata->sqpoll);
+	queue_metadata->sqpoll = NULL;
+}
+
+void
+wake_sqpoll(struct buffer_slab *queue)
+{
+	struct queue_metadata *queue_metadata = to_queue_metadata(queue);
+
+	if (queue_metadata->sqpoll)
+		wake_up(&queue_metadata->sqpoll_wait);
+}
@@ -0,0 +1,22 @@
+/*
+ * Copyright (c) 2017 Sean Wilson <spwilson2@wisc.edu>
+ *
+ * This file is released under the GPLv2
+ */
+
+#ifndef __MODULE_SRC_SQPOLL_H
+#define __MODULE_SRC_SQPOLL_H
+
+#include <as_sys/ioctl.h>
+#include "buffer.h"
+
+/* Start polling the context's submission ring as asked for by setup, 0 or -errno. */
+int start_sqpoll(struct buffer_slab *queue, struct _async_setup *setup);
+
+/* Stop the context's poller, if it has one. */
+void stop_sqpoll(struct buffer_slab *queue);
+
+/* Wake the context's poller if it went to sleep. */
+void wake_sqpoll(struct buffer_slab *queue);
+
+#endif
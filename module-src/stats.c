@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2017 Sean Wilson <spwilson2@wisc.edu>
+ *
+ * This file is released under the GPLv2
+ */
+
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/string.h>
+#include <linux/stddef.h>
+
+#include <as_sys/ioctl.h>
+#include "async_queue.h"
+#include "stats.h"
+
+/**
+ * read_queue_stats() - Sum up a context's counters for AS_SYS_STATS
+ * @queue		A pinned queue
+ * @stats		Filled in but for its ctx
+ *
+ * The cpus keep counting meanwhile, so the sums are only as consistent as
+ * any one moment's would be.
+ */
+void
+read_queue_stats(struct buffer_slab *queue, struct _async_stats *stats)
+{
+	struct queue_metadata *queue_metadata = to_queue_metadata(queue);
+	struct queue_stats *cpu_stats;
+	unsigned int i;
+	int cpu;
+
+	memset(&stats->submitted, 0, sizeof(*stats) - offsetof(struct _async_stats, submitted));
+	for_each_possible_cpu(cpu) {
+		cpu_stats = per_cpu_ptr(queue_metadata->stats, cpu);
+		stats->submitted += cpu_stats->submitted;
+		stats->completed += cpu_stats->completed;
+		stats->cq_full_stalls += cpu_stats->cq_full_stalls;
+		stats->post_spins += cpu_stats->post_spins;
+		stats->busy_ns += cpu_stats->busy_ns;
+		stats->wakeups += cpu_stats->wakeups;
+		stats->inlined += cpu_stats->inlined;
+		for (i = 0; i < AS_SYS_STATS_LATENCY_BUCKETS; i++)
+			stats->latency_us[i] += cpu_stats->latency[i];
+	}
+
+	stats->sq_depth = submissions_queued(queue_metadata);
+	stats->cq_depth = count_entries_geo(queue_metadata->event_queue,
+			&queue_metadata->event_geo);
+	stats->inflight = max(atomic_read(&queue_metadata->inflight), 0);
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2017 Sean Wilson <spwilson2@wisc.edu>
+ *
+ * This file is released under the GPLv2
+ */
+
+#ifndef __MODULE_SRC_STATS_H
+#define __MODULE_SRC_STATS_H
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+
+#include <as_sys/ioctl.h>
+#include "buffer.h"
+
+/*
+ * A context's counters, per cpu so the workers bumping them don't bounce a
+ * line between them. Only summed up when AS_SYS_STATS asks.
+ */
+struct queue_stats {
+	u64 submitted;
+	u64 completed;
+	u64 cq_full_stalls;
+	u64 post_spins;
+	u64 busy_ns;
+	u64 wakeups;
+	u64 inlined;
+	u64 latency[AS_SYS_STATS_LATENCY_BUCKETS];
+};
+
+/* See struct _async_stats for the buckets. */
+static inline unsigned int
+latency_bucket(u64 ns)
+{
+	u64 us = ns / NSEC_PER_USEC;
+
+	if (!us)
+		return 0;
+	return min_t(unsigned int, ilog2(us) + 1, AS_SYS_STATS_LATENCY_BUCKETS - 1);
+}
+
+/* Fill in everything in @stats but its ctx. */
+void read_queue_stats(struct buffer_slab *queue, struct _async_stats *stats);
+
+#endif
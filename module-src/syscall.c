@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2017 Sean Wilson <spwilson2@wisc.edu>
+ *
+ * This file is released under the GPLv2
+ */
+
+#include <linux/kernel.h>
+#include <linux/kallsyms.h>
+#include <linux/syscalls.h>
+#include <linux/errno.h>
+#include <linux/fcntl.h>
+#include <linux/fdtable.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/bitops.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/uio.h>
+#include <linux/mutex.h>
+
+#include <asm/unistd.h>
+#include <asm/ptrace.h>
+
+#include <as_sys/ioctl.h>
+#include "syscall.h"
+#include "common.h"
+
+static void **sys_call_table;
+
+typedef long (*syscall_handler_t)(long number, const __u64 args[AS_SYS_MAX_ARGS]);
+
+/*
+ * What each syscall number is run with, resolved once by init_syscalls():
+ * NULL for calls we don't run (any not in safe_syscalls), the generic
+ * sys_call_table entry for most and a direct handler for the hot ones.
+ */
+static syscall_handler_t handlers[NR_syscalls];
+
+/*
+ * The in-kernel functions behind the hot syscalls. They take their arguments
+ * as they are rather than a pt_regs the entry would have to unpack, and skip
+ * the entry's wrapper around them. Not exported, so looked up like
+ * sys_call_table is, any not found leave their syscall on the generic path.
+ */
+static ssize_t (*ksys_read_fn)(unsigned int, char __user *, size_t);
+static ssize_t (*ksys_write_fn)(unsigned int, const char __user *, size_t);
+static ssize_t (*ksys_pread64_fn)(unsigned int, char __user *, size_t, loff_t);
+static ssize_t (*ksys_pwrite64_fn)(unsigned int, const char __user *, size_t, loff_t);
+static int (*ksys_fsync_fn)(unsigned int);
+static long (*do_sys_open_fn)(int, const char __user *, int, umode_t);
+static int (*close_fd_fn)(struct files_struct *, unsigned int);
+
+/*
+ * The calls a worker runs. Each of them only acts through what the worker
+ * borrows from the submitter (its address space, files, fs_struct and
+ * credentials, see attach_submitter()) or on the objects behind its fds.
+ *
+ * Anything changing the calling thread itself stays out: its credentials
+ * (commit_creds() BUGs under the override the worker runs with), namespaces,
+ * cwd, root and umask (the worker's fs_struct is only borrowed), signal and
+ * thread state, as well as the pid family, which a worker would answer with
+ * its own ids. So does whatever can do any of that, ioctl(2), fcntl(2) and
+ * prctl(2) among them, and calls which leave state on the thread to restart
+ * with, such as nanosleep(2) and poll(2).
+ */
+static const int safe_syscalls[] = {
+	/* Reading and writing. */
+	__NR_read, __NR_write, __NR_pread64, __NR_pwrite64,
+	__NR_readv, __NR_writev, __NR_preadv, __NR_pwritev,
+	__NR_preadv2, __NR_pwritev2, __NR_lseek,
+	__NR_sendfile, __NR_splice, __NR_tee, __NR_copy_file_range,
+	__NR_readahead, __NR_fadvise64,
+	__NR_fsync, __NR_fdatasync, __NR_sync_file_range, __NR_syncfs,
+	__NR_fallocate, __NR_ftruncate, __NR_truncate, __NR_flock,
+	/* Opening and closing, in the submitter's file table. */
+	__NR_open, __NR_openat, __NR_creat, __NR_close,
+	__NR_dup, __NR_dup2, __NR_dup3,
+	/* Looking at files. */
+	__NR_stat, __NR_fstat, __NR_lstat, __NR_newfstatat, __NR_statx,
+	__NR_access, __NR_faccessat, __NR_readlink, __NR_readlinkat,
+	__NR_getdents64, __NR_statfs, __NR_fstatfs,
+	__NR_getxattr, __NR_lgetxattr, __NR_fgetxattr,
+	__NR_listxattr, __NR_llistxattr, __NR_flistxattr,
+	/* Changing them. */
+	__NR_mkdir, __NR_mkdirat, __NR_rmdir, __NR_unlink, __NR_unlinkat,
+	__NR_rename, __NR_renameat, __NR_renameat2,
+	__NR_link, __NR_linkat, __NR_symlink, __NR_symlinkat,
+	__NR_chmod, __NR_fchmod, __NR_fchmodat,
+	__NR_chown, __NR_fchown, __NR_lchown, __NR_fchownat, __NR_utimensat,
+	__NR_setxattr, __NR_lsetxattr, __NR_fsetxattr,
+	__NR_removexattr, __NR_lremovexattr, __NR_fremovexattr,
+	/* Sockets. */
+	__NR_socket, __NR_socketpair, __NR_bind, __NR_listen,
+	__NR_connect, __NR_accept, __NR_accept4, __NR_shutdown,
+	__NR_sendto, __NR_recvfrom, __NR_sendmsg, __NR_recvmsg,
+	__NR_sendmmsg, __NR_recvmmsg,
+	__NR_getsockname, __NR_getpeername, __NR_setsockopt, __NR_getsockopt,
+	/* The borrowed credentials, as the submitter has them. */
+	__NR_getuid, __NR_geteuid, __NR_getgid, __NR_getegid,
+};
+
+static long
+generic_syscall(long number, const __u64 args[AS_SYS_MAX_ARGS])
+{
+#ifdef CONFIG_ARCH_HAS_SYSCALL_WRAPPER
+	/* Entries take the registers of the syscall entry. */
+	struct pt_regs regs = {
+		.di = args[0], .si = args[1], .dx = args[2],
+		.r10 = args[3], .r8 = args[4], .r9 = args[5],
+		.orig_ax = number,
+	};
+	long (*entry)(const struct pt_regs *) = sys_call_table[number];
+
+	return entry(&regs);
+#else
+	long (*entry)(unsigned long, unsigned long, unsigned long,
+			unsigned long, unsigned long, unsigned long) = sys_call_table[number];
+
+	return entry(args[0], args[1], args[2], args[3], args[4], args[5]);
+#endif
+}
+
+static long
+read_handler(long number, const __u64 args[AS_SYS_MAX_ARGS])
+{
+	return ksys_read_fn(args[0], (char __user *)args[1], args[2]);
+}
+
+static long
+write_handler(long number, const __u64 args[AS_SYS_MAX_ARGS])
+{
+	return ksys_write_fn(args[0], (const char __user *)args[1], args[2]);
+}
+
+static long
+pread64_handler(long number, const __u64 args[AS_SYS_MAX_ARGS])
+{
+	return ksys_pread64_fn(args[0], (char __user *)args[1], args[2], args[3]);
+}
+
+static long
+pwrite64_handler(long number, const __u64 args[AS_SYS_MAX_ARGS])
+{
+	return ksys_pwrite64_fn(args[0], (const char __user *)args[1], args[2], args[3]);
+}
+
+static long
+fsync_handler(long number, const __u64 args[AS_SYS_MAX_ARGS])
+{
+	return ksys_fsync_fn(args[0]);
+}
+
+static long
+openat_handler(long number, const __u64 args[AS_SYS_MAX_ARGS])
+{
+	/* As sys_openat(), which forces O_LARGEFILE on 64 bit. */
+	int flags = args[2];
+
+	if (force_o_largefile())
+		flags |= O_LARGEFILE;
+	return do_sys_open_fn(args[0], (const char __user *)args[1], flags, args[3]);
+}
+
+static long
+close_handler(long number, const __u64 args[AS_SYS_MAX_ARGS])
+{
+	/* The worker took on the submitter's files, see attach_submitter(). */
+	long ret = close_fd_fn(current->files, args[0]);
+
+	/* As sys_close(), a close interrupted after the fd is gone still closed it. */
+	if (unlikely(ret == -ERESTARTSYS || ret == -ERESTARTNOINTR ||
+		     ret == -ERESTARTNOHAND || ret == -ERESTART_RESTARTBLOCK))
+		ret = -EINTR;
+	return ret;
+}
+
+/* Point a hot syscall at its direct handler, if its function could be found. */
+#define DIRECT_HANDLER(nr, fn, name, handler)				\
+	do {								\
+		if (((fn) = (void *)kallsyms_lookup_name(name)))	\
+			handlers[nr] = (handler);			\
+	} while (0)
+
+int
+init_syscalls(void)
+{
+	size_t i;
+
+	sys_call_table = (void**) kallsyms_lookup_name("sys_call_table");
+	mpr_info("sys_call_table addr: %p\n", sys_call_table);
+	if (!sys_call_table)
+		return false;
+
+	for (i = 0; i < ARRAY_SIZE(safe_syscalls); i++)
+		handlers[safe_syscalls[i]] = generic_syscall;
+
+	DIRECT_HANDLER(__NR_read, ksys_read_fn, "ksys_read", read_handler);
+	DIRECT_HANDLER(__NR_write, ksys_write_fn, "ksys_write", write_handler);
+	DIRECT_HANDLER(__NR_pread64, ksys_pread64_fn, "ksys_pread64", pread64_handler);
+	DIRECT_HANDLER(__NR_pwrite64, ksys_pwrite64_fn, "ksys_pwrite64", pwrite64_handler);
+	DIRECT_HANDLER(__NR_fsync, ksys_fsync_fn, "ksys_fsync", fsync_handler);
+	DIRECT_HANDLER(__NR_openat, do_sys_open_fn, "do_sys_open", openat_handler);
+	DIRECT_HANDLER(__NR_close, close_fd_fn, "__close_fd", close_handler);
+	return true;
+}
+
+int
+syscall_supported(long number)
+{
+	return number >= 0 && number < NR_syscalls && handlers[number];
+}
+
+/**
+ * alloc_allowlist() - Build the bitmap of a context's AS_SYS_SETUP_ALLOWLIST
+ * @numbers		User array of syscall numbers
+ * @nr			How many, at most AS_SYS_MAX_ALLOWLIST
+ * @allowed		Set to the bitmap on success, to be kfree()d
+ *
+ * Return:		0, -EINVAL if a number isn't one we run, -EFAULT or
+ *			-ENOMEM.
+ */
+int
+alloc_allowlist(const __s32 __user *numbers, unsigned int nr, unsigned long **allowed)
+{
+	unsigned long *bitmap;
+	unsigned int i;
+	__s32 number;
+
+	if (nr > AS_SYS_MAX_ALLOWLIST)
+		return -EINVAL;
+
+	bitmap = kcalloc(BITS_TO_LONGS(NR_syscalls), sizeof(*bitmap), GFP_KERNEL);
+	if (!bitmap)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		if (get_user(number, &numbers[i])) {
+			kfree(bitmap);
+			return -EFAULT;
+		}
+		if (!syscall_supported(number)) {
+			kfree(bitmap);
+			return -EINVAL;
+		}
+		__set_bit(number, bitmap);
+	}
+
+	*allowed = bitmap;
+	return 0;
+}
+
+/*
+ * A file's read only came up short because the rest wasn't cached, a worker
+ * waits for it. Streams hand over what they have, as a blocking read would,
+ * and what they handed over is gone anyway.
+ */
+static inline bool
+short_nowait_read(struct file *file, long ret, size_t len)
+{
+	umode_t mode = file_inode(file)->i_mode;
+
+	return ret > 0 && ret < len && (S_ISREG(mode) || S_ISBLK(mode));
+}
+
+/*
+ * read(2) or pread64(2), as with RWF_NOWAIT: -EAGAIN rather than waiting
+ * for the disk or on someone else holding the file position. Only files
+ * which support that take part, others get -EAGAIN as well, and so does a
+ * read of a file which only found part of the range cached. The file
+ * position is left alone then, the worker reads it all again.
+ */
+static long
+nowait_read(const __u64 args[AS_SYS_MAX_ARGS], bool positional)
+{
+	struct iovec iov;
+	struct iov_iter iter;
+	struct file *file;
+	loff_t pos = args[3];
+	long ret;
+
+	if ((ret = import_single_range(READ, (void __user *)args[1], args[2], &iov, &iter)))
+		return ret;
+	if (!(file = fget(args[0])))
+		return -EBADF;
+
+	if (!(file->f_mode & FMODE_NOWAIT)) {
+		ret = -EAGAIN;
+	} else if (positional) {
+		ret = file->f_mode & FMODE_PREAD ?
+			vfs_iter_read(file, &iter, &pos, RWF_NOWAIT) : -ESPIPE;
+		if (short_nowait_read(file, ret, args[2]))
+			ret = -EAGAIN;
+	} else if (!mutex_trylock(&file->f_pos_lock)) {
+		ret = -EAGAIN;
+	} else {
+		pos = file->f_pos;
+		ret = vfs_iter_read(file, &iter, &pos, RWF_NOWAIT);
+		if (short_nowait_read(file, ret, args[2]))
+			ret = -EAGAIN;
+		else if (ret >= 0)
+			file->f_pos = pos;
+		mutex_unlock(&file->f_pos_lock);
+	}
+	fput(file);
+	return ret == -EOPNOTSUPP ? -EAGAIN : ret;
+}
+
+/**
+ * try_inline_syscall() - Run a syscall for AS_SYS_CB_INLINE, if it can't block
+ * @number		A syscall the workers run
+ * @args		Its arguments
+ *
+ * The calls which only read the user and group ids are run as they are, they
+ * go by the credentials a worker would have as well. Not so the pid family:
+ * a worker answers those with its own ids, not the submitter's, and running
+ * them here would make the result depend on where the call ran. Reads are
+ * only of what is in the page cache, all of it. Anything else is left to the
+ * workers.
+ *
+ * Return:		What the syscall returned, -EAGAIN if it would have had
+ *			to block (or might have).
+ */
+long
+try_inline_syscall(long number, const __u64 args[AS_SYS_MAX_ARGS])
+{
+	switch (number) {
+		case __NR_getuid:
+		case __NR_geteuid:
+		case __NR_getgid:
+		case __NR_getegid:
+			return do_async_syscall(number, args);
+		case __NR_read:
+			return nowait_read(args, false);
+		case __NR_pread64:
+			return nowait_read(args, true);
+		default:
+			return -EAGAIN;
+	}
+}
+
+long
+do_async_syscall(long number, const __u64 args[AS_SYS_MAX_ARGS])
+{
+	if (!syscall_supported(number))
+		return -ENOSYS;
+	return handlers[number](number, args);
+}
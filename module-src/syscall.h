@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2017 Sean Wilson <spwilson2@wisc.edu>
+ *
+ * This file is released under the GPLv2
+ */
+
+#ifndef __MODULE_SRC_SYSCALL_H
+#define __MODULE_SRC_SYSCALL_H
+
+#include <linux/types.h>
+#include <as_sys/ioctl.h>
+
+/* Find the syscall table, must succeed before any syscall is dispatched. */
+int init_syscalls(void);
+
+/* Whether syscall `number` is one the workers run. */
+int syscall_supported(long number);
+
+/* See AS_SYS_SETUP_ALLOWLIST, returns 0 or a negative errno. */
+int alloc_allowlist(const __s32 __user *numbers, unsigned int nr, unsigned long **allowed);
+
+/*
+ * Run syscall `number` with the given arguments as the current task. The
+ * caller is responsible for having switched into the submitter's context.
+ */
+long do_async_syscall(long number, const __u64 args[AS_SYS_MAX_ARGS]);
+
+/*
+ * As do_async_syscall() for the few calls which can be run without blocking,
+ * -EAGAIN for any other or if it would have blocked.
+ */
+long try_inline_syscall(long number, const __u64 args[AS_SYS_MAX_ARGS]);
+
+#endif
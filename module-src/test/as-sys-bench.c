@@ -0,0 +1,175 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "../../include/as_sys/ioctl.h"
+#include "../../shared-libs/circle_buffer.h"
+#include "../../shared-libs/test/bench.h"
+
+/*
+ * Submit+reap of getuid() through /dev/as_sys against calling getuid()
+ * directly, sweeping submitting threads, ring and batch sizes. Each thread gets
+ * a context of its own, submits a batch, notifies the workers and waits for
+ * the whole batch in GETEVENTS. Latency is from push to reap. The cons column
+ * is 0 since the kernel workers do the consuming.
+ *
+ * Usage: as-sys-bench [calls per configuration]
+ */
+
+#define DEFAULT_OPS 100000
+
+static const int threads[] = { 1, 2, 4 };
+static const size_t rings[] = { 64, 1024 };
+static const size_t batches[] = { 1, 16, 64, 256 };
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+struct submitter {
+    pthread_t thread;
+    int fd;
+    size_t ring;
+    size_t batch;
+    size_t ops;
+    uint64_t *samples;
+    int failed;
+};
+
+static const char fname[] = "/dev/as_sys";
+
+static void* submit_async(void* submitter_p) {
+    struct submitter *submitter = submitter_p;
+    async_context_t ctx_id;
+    struct _async_setup setup = { .nr_events = submitter->ring, .ctx_idp = &ctx_id };
+    long page_size = sysconf(_SC_PAGESIZE);
+    struct async_cb *cbs = calloc(submitter->batch, sizeof(*cbs));
+    struct async_event *events = calloc(submitter->batch, sizeof(*events));
+    struct _async_getevents getevents = { .max_nr = submitter->batch,
+        .min_nr = submitter->batch, .events = events };
+    size_t done = 0;
+    uint64_t now;
+    void *sq;
+    long got;
+
+    submitter->failed = 1;
+    if (!cbs || !events || ioctl(submitter->fd, AS_SYS_SETUP, &setup))
+        return NULL;
+    getevents.ctx = ctx_id;
+    sq = mmap(NULL, setup.sq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+              submitter->fd, AS_SYS_MMAP_PGOFF(ctx_id, AS_SYS_RING_SQ) * page_size);
+    if (sq == MAP_FAILED)
+        goto destroy;
+
+    for (size_t i = 0; i < submitter->batch; i++)
+        cbs[i].number = SYS_getuid;
+
+    while (done < submitter->ops) {
+        // The submission time rides along as the cookie.
+        now = now_ns();
+        for (size_t i = 0; i < submitter->batch; i++)
+            cbs[i].user_data = now;
+        push_n(sq, cbs, submitter->batch);
+        if (ioctl(submitter->fd, AS_SYS_NOTIFY, ctx_id))
+            goto unmap;
+
+        for (size_t reaped = 0; reaped < submitter->batch; reaped += got) {
+            getevents.min_nr = getevents.max_nr = submitter->batch - reaped;
+            got = ioctl(submitter->fd, AS_SYS_GETEVENTS, &getevents);
+            if (got < 0 && errno == EINTR) {
+                got = 0;
+                continue;
+            }
+            if (got <= 0)
+                goto unmap;
+            now = now_ns();
+            for (long i = 0; i < got; i++)
+                submitter->samples[done++] = now - events[i].user_data;
+        }
+    }
+    submitter->failed = 0;
+
+unmap:
+    munmap(sq, setup.sq_ring_bytes);
+destroy:
+    ioctl(submitter->fd, AS_SYS_DESTROY, ctx_id);
+    free(cbs);
+    free(events);
+    return NULL;
+}
+
+static void* submit_direct(void* submitter_p) {
+    struct submitter *submitter = submitter_p;
+    uint64_t start;
+
+    for (size_t i = 0; i < submitter->ops; i++) {
+        start = now_ns();
+        syscall(SYS_getuid);
+        submitter->samples[i] = now_ns() - start;
+    }
+    submitter->failed = 0;
+    return NULL;
+}
+
+static int run(const char *name, void* (*fn)(void*), int fd, int nr_threads,
+               size_t ring, size_t batch, size_t ops) {
+    struct submitter submitters[nr_threads];
+    uint64_t *samples, start, elapsed;
+    int failed = 0;
+
+    ops = ops / (nr_threads * batch) * nr_threads * batch;
+    samples = malloc(ops * sizeof(*samples));
+    if (!samples)
+        return 1;
+
+    start = now_ns();
+    for (int i = 0; i < nr_threads; i++) {
+        submitters[i] = (struct submitter){ .fd = fd, .ring = ring, .batch = batch,
+            .ops = ops / nr_threads, .samples = samples + i * (ops / nr_threads) };
+        if (pthread_create(&submitters[i].thread, NULL, fn, &submitters[i]))
+            return 1;
+    }
+    for (int i = 0; i < nr_threads; i++) {
+        pthread_join(submitters[i].thread, NULL);
+        failed |= submitters[i].failed;
+    }
+    elapsed = now_ns() - start;
+
+    if (!failed)
+        report(name, nr_threads, 0, ring, batch, ops, elapsed, samples, ops);
+    free(samples);
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    size_t ops = argc > 1 ? strtoul(argv[1], NULL, 0) : DEFAULT_OPS;
+    int fd = open(fname, O_RDWR);
+
+    if (fd < 0) {
+        perror(fname);
+        return 1;
+    }
+
+    print_header();
+    for (size_t t = 0; t < ARRAY_SIZE(threads); t++) {
+        if (run("getuid (direct)", submit_direct, fd, threads[t], 0, 1, ops))
+            goto fail;
+        for (size_t r = 0; r < ARRAY_SIZE(rings); r++)
+            for (size_t b = 0; b < ARRAY_SIZE(batches) && batches[b] <= rings[r]; b++)
+                if (run("getuid (as_sys)", submit_async, fd, threads[t],
+                        rings[r], batches[b], ops))
+                    goto fail;
+    }
+    close(fd);
+    return 0;
+
+fail:
+    fprintf(stderr, "FAIL\n");
+    close(fd);
+    return 1;
+}
@@ -1,17 +1,23 @@
 #include <stdio.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/types.h>
+#include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
 
 #include <sys/syscall.h>
 #include "../../include/as_sys/ioctl.h"
+#include "../../shared-libs/circle_buffer.h"
 
 int main(void) {
     const static char fname[] = "/dev/as_sys";
     async_context_t ctx_id;
-    struct _async_setup async_setup_args = {.nr_events = 1, .ctx_idp = &ctx_id};
+    struct _async_setup async_setup_args = {.nr_events = 2, .ctx_idp = &ctx_id};
 	int fd;
 	if( access(fname , F_OK ) != -1 ) {
 		fd = open(fname, O_RDWR);
@@ -24,6 +30,148 @@ int main(void) {
 		ioctl(fd, _IOWR(SYS_exit,2,sizeof(int)), (int)SYS_exit, (int)33);
 		ioctl(fd, AS_SYS_SETUP, &async_setup_args);
 
+		// Both rings should map and start with an empty circle_buffer.
+		long page_size = sysconf(_SC_PAGESIZE);
+		void *sq = mmap(NULL, async_setup_args.sq_ring_bytes, PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, AS_SYS_MMAP_PGOFF(ctx_id, AS_SYS_RING_SQ) * page_size);
+		void *cq = mmap(NULL, async_setup_args.cq_ring_bytes, PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, AS_SYS_MMAP_PGOFF(ctx_id, AS_SYS_RING_CQ) * page_size);
+		if (sq == MAP_FAILED || cq == MAP_FAILED)
+			printf("FAILED TO MAP RINGS\n");
+		else
+			printf("sq: %p (%lu bytes), cq: %p (%lu bytes)\n",
+					sq, async_setup_args.sq_ring_bytes,
+					cq, async_setup_args.cq_ring_bytes);
+
+		// Nothing has been submitted, so both should come back empty.
+		struct async_event events[1];
+		struct timespec timeout = {.tv_sec = 0, .tv_nsec = 10000000};
+		struct _async_getevents getevents_args = {.ctx = ctx_id,
+			.min_nr = 0, .max_nr = 1, .events = events, .timeout = NULL};
+		printf("getevents (check): %d\n", ioctl(fd, AS_SYS_GETEVENTS, &getevents_args));
+		getevents_args.min_nr = 1;
+		getevents_args.timeout = &timeout;
+		printf("getevents (10ms): %d\n", ioctl(fd, AS_SYS_GETEVENTS, &getevents_args));
+
+		// Have a worker run getuid() for us.
+		struct async_cb getuid_cb = {.number = SYS_getuid, .user_data = 1};
+		if (sq != MAP_FAILED) {
+			push(sq, &getuid_cb);
+			ioctl(fd, AS_SYS_NOTIFY, ctx_id);
+			getevents_args.timeout = NULL;
+			if (ioctl(fd, AS_SYS_GETEVENTS, &getevents_args) == 1)
+				printf("getuid: %lld (expected %d), user_data ok: %d\n",
+						(long long)events[0].res, getuid(),
+						events[0].user_data == 1);
+			else
+				printf("FAILED TO GET EVENT\n");
+		}
+
+		// The same without the rings, submitting and waiting in one ioctl.
+		struct async_cb *getuid_cbp = &getuid_cb;
+		struct _async_submit submit_args = {.ctx = ctx_id, .nr = 1,
+			.cbs = &getuid_cbp, .min_nr = 1, .max_nr = 1, .events = events};
+		if (ioctl(fd, AS_SYS_SUBMIT, &submit_args) == 1 && submit_args.nr_reaped == 1)
+			printf("getuid (submit): %lld (expected %d)\n",
+					(long long)events[0].res, getuid());
+		else
+			printf("FAILED TO SUBMIT\n");
+
+		// Inline calls complete before the ioctl returns.
+		struct async_cb inline_cb = {.number = SYS_getuid, .flags = AS_SYS_CB_INLINE,
+			.user_data = 2};
+		struct async_cb *inline_cbp = &inline_cb;
+		struct _async_submit inline_args = {.ctx = ctx_id, .nr = 1, .cbs = &inline_cbp};
+		struct _async_stats inline_stats = {.ctx = ctx_id};
+		if (ioctl(fd, AS_SYS_SUBMIT, &inline_args) == 1 &&
+		    ioctl(fd, AS_SYS_STATS, &inline_stats) == 0)
+			printf("inline: %llu (expected 1), cq depth %llu\n",
+					(unsigned long long)inline_stats.inlined,
+					(unsigned long long)inline_stats.cq_depth);
+		else
+			printf("FAILED TO SUBMIT INLINE\n");
+		getevents_args.min_nr = 1;
+		if (ioctl(fd, AS_SYS_GETEVENTS, &getevents_args) != 1 || events[0].user_data != 2 ||
+		    events[0].res != getuid())
+			printf("FAILED TO GET INLINE EVENT\n");
+
+		// Waiting only leaves the event on the ring, to be read in place.
+		if (sq != MAP_FAILED && cq != MAP_FAILED) {
+			struct _async_getevents wait_args = {.ctx = ctx_id, .min_nr = 1};
+			struct async_event *event;
+			push(sq, &getuid_cb);
+			ioctl(fd, AS_SYS_NOTIFY, ctx_id);
+			if (ioctl(fd, AS_SYS_GETEVENTS, &wait_args) == 1 &&
+			    (event = peek_slot(cq, ((circle_buffer *)cq)->head_idx)))
+				printf("getuid (in place): %lld (expected %d), seen: %zu\n",
+						(long long)event->res, getuid(), advance_head(cq, 1));
+			else
+				printf("FAILED TO WAIT FOR EVENT\n");
+		}
+
+		// A failing step cancels the rest of its chain, in order.
+		struct async_cb chain[2] = {
+			{.number = SYS_close, .flags = AS_SYS_CB_LINK,
+				.args = {(__u64)-1}, .user_data = 0},
+			{.number = SYS_getuid, .user_data = 1},
+		};
+		if (sq != MAP_FAILED) {
+			push_n(sq, chain, 2);
+			ioctl(fd, AS_SYS_NOTIFY, ctx_id);
+			for (int i = 0; i < 2; i++) {
+				if (ioctl(fd, AS_SYS_GETEVENTS, &getevents_args) != 1) {
+					printf("FAILED TO GET EVENT\n");
+					break;
+				}
+				printf("chain %d: %lld (%s)\n", i, (long long)events[0].res,
+						events[0].user_data == i ?
+						"in order" : "OUT OF ORDER");
+			}
+		}
+
+		// Completions signal the registered eventfd, and poll(2) on the device.
+		int efd = eventfd(0, 0);
+		struct _async_eventfd eventfd_args = {.ctx = ctx_id, .fd = efd};
+		if (sq != MAP_FAILED &&
+		    ioctl(fd, AS_SYS_REGISTER_EVENTFD, &eventfd_args) == 0) {
+			struct pollfd pfd = {.fd = fd, .events = POLLIN};
+			uint64_t count;
+			push(sq, &getuid_cb);
+			ioctl(fd, AS_SYS_NOTIFY, ctx_id);
+			if (read(efd, &count, sizeof(count)) == sizeof(count))
+				printf("eventfd: %llu, poll: %d\n", (unsigned long long)count,
+						poll(&pfd, 1, 0));
+			getevents_args.min_nr = 0;
+			printf("getevents (eventfd): %d\n",
+					ioctl(fd, AS_SYS_GETEVENTS, &getevents_args));
+		} else {
+			printf("FAILED TO REGISTER EVENTFD\n");
+		}
+
+		// Nothing is left to cancel.
+		struct _async_cancel cancel_args = {.ctx = ctx_id, .user_data = 1};
+		printf("cancel (nothing queued): %d (expected -1)\n",
+				ioctl(fd, AS_SYS_CANCEL, &cancel_args));
+
+		// Every call so far was taken off the ring and completed.
+		struct _async_stats stats = {.ctx = ctx_id};
+		if (ioctl(fd, AS_SYS_STATS, &stats) == 0)
+			printf("stats: submitted %llu, completed %llu, cq depth %llu\n",
+					(unsigned long long)stats.submitted,
+					(unsigned long long)stats.completed,
+					(unsigned long long)stats.cq_depth);
+		else
+			printf("FAILED TO GET STATS\n");
+
+		// A destroyed context's id doesn't find the one set up after it.
+		async_context_t old_ctx_id = ctx_id;
+		ioctl(fd, AS_SYS_DESTROY, old_ctx_id);
+		if (ioctl(fd, AS_SYS_SETUP, &async_setup_args) == 0)
+			printf("notify (stale id): %d (expected -1)\n",
+					ioctl(fd, AS_SYS_NOTIFY, old_ctx_id));
+		else
+			printf("FAILED TO SET UP AGAIN\n");
+
 	} else {
 		printf("FAILED TO OPEN FILE\n");
 	}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2017 Sean Wilson <spwilson2@wisc.edu>
+ *
+ * This file is released under the GPLv2
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM as_sys
+
+#if !defined(__MODULE_SRC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define __MODULE_SRC_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * A call's way through a context: the process NOTIFYs of its submissions, a
+ * worker takes them off the ring (dispatch) and posts an event for each
+ * (complete), while the process reaps in GETEVENTS (wait).
+ */
+
+TRACE_EVENT(as_sys_submit,
+	TP_PROTO(unsigned long ctx, size_t pending),
+	TP_ARGS(ctx, pending),
+	TP_STRUCT__entry(
+		__field(unsigned long, ctx)
+		__field(size_t, pending)
+	),
+	TP_fast_assign(
+		__entry->ctx = ctx;
+		__entry->pending = pending;
+	),
+	TP_printk("ctx=%lu pending=%zu", __entry->ctx, __entry->pending)
+);
+
+TRACE_EVENT(as_sys_dispatch,
+	TP_PROTO(unsigned long ctx, long number, __u64 user_data, size_t nr,
+		int inflight),
+	TP_ARGS(ctx, number, user_data, nr, inflight),
+	TP_STRUCT__entry(
+		__field(unsigned long, ctx)
+		__field(long, number)
+		__field(__u64, user_data)
+		__field(size_t, nr)
+		__field(int, inflight)
+	),
+	TP_fast_assign(
+		__entry->ctx = ctx;
+		__entry->number = number;
+		__entry->user_data = user_data;
+		__entry->nr = nr;
+		__entry->inflight = inflight;
+	),
+	TP_printk("ctx=%lu number=%ld user_data=0x%llx nr=%zu inflight=%d",
+		__entry->ctx, __entry->number,
+		(unsigned long long)__entry->user_data, __entry->nr,
+		__entry->inflight)
+);
+
+TRACE_EVENT(as_sys_complete,
+	TP_PROTO(unsigned long ctx, __u64 user_data, __s64 res, u64 latency_ns),
+	TP_ARGS(ctx, user_data, res, latency_ns),
+	TP_STRUCT__entry(
+		__field(unsigned long, ctx)
+		__field(__u64, user_data)
+		__field(__s64, res)
+		__field(u64, latency_ns)
+	),
+	TP_fast_assign(
+		__entry->ctx = ctx;
+		__entry->user_data = user_data;
+		__entry->res = res;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("ctx=%lu user_data=0x%llx res=%lld latency_ns=%llu",
+		__entry->ctx, (unsigned long long)__entry->user_data,
+		(long long)__entry->res, (unsigned long long)__entry->latency_ns)
+);
+
+TRACE_EVENT(as_sys_wait,
+	TP_PROTO(unsigned long ctx, long min_nr, long ret),
+	TP_ARGS(ctx, min_nr, ret),
+	TP_STRUCT__entry(
+		__field(unsigned long, ctx)
+		__field(long, min_nr)
+		__field(long, ret)
+	),
+	TP_fast_assign(
+		__entry->ctx = ctx;
+		__entry->min_nr = min_nr;
+		__entry->ret = ret;
+	),
+	TP_printk("ctx=%lu min_nr=%ld ret=%ld", __entry->ctx, __entry->min_nr,
+		__entry->ret)
+);
+
+#endif
+
+/* Out of the kernel tree, so define_trace.h must look for us next to the sources. */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
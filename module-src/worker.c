@@ -0,0 +1,840 @@
+/*
+ * Copyright (c) 2017 Sean Wilson <spwilson2@wisc.edu>
+ *
+ * This file is released under the GPLv2
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/sched/mm.h>
+#include <linux/mmu_context.h>
+#include <linux/fdtable.h>
+#include <linux/fs_struct.h>
+#include <linux/kallsyms.h>
+#include <linux/cred.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/list.h>
+#include <linux/uaccess.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/cpumask.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/timer.h>
+#include <linux/signal.h>
+#include <linux/jiffies.h>
+
+#include <as_sys/ioctl.h>
+#include "async_queue.h"
+#include "syscall.h"
+#include "registered.h"
+#include "worker.h"
+#include "common.h"
+
+static unsigned int nr_workers;
+module_param(nr_workers, uint, S_IRUGO);
+MODULE_PARM_DESC(nr_workers, "Number of kernel threads running submitted syscalls, split between the nodes by their cpus (default: one per online cpu)");
+
+/*
+ * Workers are shared by every context on their node. A context with
+ * submissions pending is linked into `runnable` of its node's pool and the
+ * next free worker takes a single submission (or chain) off it, putting the
+ * context back if more remain. So a context never holds on to a worker while
+ * others wait and a second blocking call in the same context is picked up by
+ * another worker rather than queueing behind the first.
+ *
+ * Contexts are served by deficit round robin: each is taken from up to its
+ * weight times in a row, going back to the head of `runnable` while it has
+ * credit left and to the tail with its credit refilled once it's used up. A
+ * bulk context with a huge ring thus gets no more of the workers than its
+ * weight says whatever it has queued. A context with max_workers set isn't
+ * queued while that many workers run its calls, the last one to finish puts it
+ * back, so the workers it doesn't use stay free for everyone else.
+ *
+ * Running a call means running in the submitter's address space, and
+ * switching a worker between address spaces costs it its TLB (and much of
+ * its cache). So a worker stays in the last one it ran in for as long as it
+ * keeps busy, dropping it only for another one or before going to sleep, and
+ * prefers contexts of that address space: the first of them among the
+ * MM_AFFINITY_SCAN contexts at the head of `runnable`. It only jumps the
+ * queue like that MM_AFFINITY_RUN times in a row before taking the head
+ * again, so the other address spaces still get their turn.
+ *
+ * The workers of a pool only run on the cpus of its node, next to the rings
+ * of the contexts they serve. Nodes without cpus get no workers, their
+ * contexts are served by fallback_pool.
+ */
+#define MM_AFFINITY_SCAN 8
+#define MM_AFFINITY_RUN 16
+
+struct worker_pool {
+	spinlock_t lock;
+	struct list_head runnable;
+	wait_queue_head_t wait;
+
+	unsigned int nr_workers;
+	struct worker **workers;
+};
+
+struct worker {
+	struct task_struct *thread;
+	struct worker_pool *pool;
+
+	/*
+	 * What the worker is running, for cancel_running() and the timer to
+	 * find. Under lock (taken from the timer too, so _bh elsewhere):
+	 * running is the context of cbs[0..nr) while they are being run, cur
+	 * the next one to start and calling whether cbs[cur] is in its call.
+	 */
+	spinlock_t lock;
+	struct queue_metadata *running;
+	size_t cur, nr;
+	bool calling;
+	/* Why the call was sent SIGKILL, if it was. */
+	bool canceled, timed_out;
+	/* Armed for AS_SYS_CB_TIMEOUT calls. */
+	struct timer_list timer;
+
+	/*
+	 * The address space the worker is in, kept from one submission to the
+	 * next, see worker_use_mm(). affinity_run counts the contexts in a row
+	 * it took for being in it rather than for being next.
+	 */
+	struct mm_struct *mm;
+	mm_segment_t fs;
+	unsigned int affinity_run;
+
+	/* What the worker took off a ring, a whole chain at most. */
+	struct async_cb cbs[AS_SYS_MAX_LINKS];
+};
+
+static struct worker_pool *pools; /* Indexed by node. */
+static struct worker_pool *fallback_pool;
+
+static inline struct worker_pool *
+pool_of(struct queue_metadata *queue_metadata)
+{
+	struct worker_pool *pool = &pools[queue_metadata->numa_node];
+
+	return pool->nr_workers ? pool : fallback_pool;
+}
+
+/* What a worker switched out to run as the submitter, see attach_submitter(). */
+struct submitter_state {
+	struct files_struct *files;
+	struct fs_struct *fs;
+	const struct cred *cred;
+};
+
+/* Not exported, looked up by init_workers() as the syscalls are. */
+static void (*free_fs_struct_fn)(struct fs_struct *);
+
+static inline bool
+at_max_workers(struct queue_metadata *queue_metadata)
+{
+	return queue_metadata->max_workers &&
+		atomic_read(&queue_metadata->active_workers) >= queue_metadata->max_workers;
+}
+
+/*
+ * Tell submitters a worker is leaving the context, before it looks at the
+ * rings a last time, see AS_SYS_SQ_WORKERS_IDLE. The caller orders it before
+ * the look with a full barrier. Both only write the shared line if they
+ * change it.
+ */
+static inline void
+set_workers_idle(struct queue_metadata *queue_metadata)
+{
+	circle_buffer *syscall_queue = queue_metadata->syscall_queue;
+
+	if (!(READ_ONCE(syscall_queue->flags) & AS_SYS_SQ_WORKERS_IDLE))
+		__sync_fetch_and_or(&syscall_queue->flags, AS_SYS_SQ_WORKERS_IDLE);
+}
+
+/* Once queued, a worker will look at the rings before it leaves again. */
+static inline void
+clear_workers_idle(struct queue_metadata *queue_metadata)
+{
+	circle_buffer *syscall_queue = queue_metadata->syscall_queue;
+
+	if (READ_ONCE(syscall_queue->flags) & AS_SYS_SQ_WORKERS_IDLE)
+		__sync_fetch_and_and(&syscall_queue->flags, ~AS_SYS_SQ_WORKERS_IDLE);
+}
+
+/* Must be called holding pool->lock */
+static inline void
+__queue_runnable(struct worker_pool *pool, struct buffer_slab *queue)
+{
+	struct queue_metadata *queue_metadata = to_queue_metadata(queue);
+
+	if (queue_metadata->queued || at_max_workers(queue_metadata))
+		return;
+
+	/* The run list holds its own reference. */
+	hold_buffer(queue);
+	queue_metadata->queued = true;
+	clear_workers_idle(queue_metadata);
+	if (queue_metadata->credit) {
+		/* The rest of its turn. */
+		list_add(&queue_metadata->run_list, &pool->runnable);
+	} else {
+		queue_metadata->credit = queue_metadata->weight;
+		list_add_tail(&queue_metadata->run_list, &pool->runnable);
+	}
+}
+
+void
+kick_workers(struct buffer_slab *queue)
+{
+	struct queue_metadata *queue_metadata = to_queue_metadata(queue);
+	struct worker_pool *pool = pool_of(queue_metadata);
+
+	/*
+	 * A context already queued will be looked at again by a worker after
+	 * it leaves the list, so it is safe to skip locking for it. Pollers
+	 * rely on that to kick repeatedly for cheap.
+	 *
+	 * What was pushed has to be visible before queued is looked at,
+	 * pairing with the barrier after a worker clears it in
+	 * next_runnable(): either we see it off the list, or it sees the push.
+	 */
+	smp_mb();
+	if (queue_metadata->dead || READ_ONCE(queue_metadata->queued) ||
+	    !submissions_pending(queue_metadata))
+		return;
+	/*
+	 * Likewise for active_workers and finish_runnable(), only the other
+	 * way around: we say we were here before looking, the worker drops
+	 * active_workers before looking at whether we were. Either we see a
+	 * worker free, or the last one kicks for us on its way out.
+	 */
+	if (queue_metadata->max_workers) {
+		WRITE_ONCE(queue_metadata->kick_missed, true);
+		smp_mb();
+		if (at_max_workers(queue_metadata))
+			return;
+	}
+
+	spin_lock(&pool->lock);
+	__queue_runnable(pool, queue);
+	spin_unlock(&pool->lock);
+	/* Workers wait exclusively, one context queued wakes one of them. */
+	wake_up(&pool->wait);
+}
+
+/*
+ * Take the context whose turn it is, or one in the worker's address space
+ * close behind it, along with the list's reference. It counts as run by the
+ * worker until finish_runnable().
+ */
+static struct buffer_slab *
+next_runnable(struct worker_pool *pool, struct worker *worker)
+{
+	struct queue_metadata *queue_metadata, *first;
+	struct buffer_slab *queue = NULL;
+	unsigned int scanned = 0;
+
+	spin_lock(&pool->lock);
+	if (!list_empty(&pool->runnable)) {
+		first = list_first_entry(&pool->runnable, struct queue_metadata, run_list);
+		queue_metadata = first;
+		if (worker->mm && worker->affinity_run < MM_AFFINITY_RUN) {
+			list_for_each_entry(queue_metadata, &pool->runnable, run_list) {
+				if (queue_metadata->mm == worker->mm)
+					break;
+				if (++scanned == MM_AFFINITY_SCAN) {
+					queue_metadata = first;
+					break;
+				}
+			}
+			if (&queue_metadata->run_list == &pool->runnable)
+				queue_metadata = first;
+		}
+		worker->affinity_run = queue_metadata == first ? 0 : worker->affinity_run + 1;
+
+		list_del_init(&queue_metadata->run_list);
+		queue_metadata->queued = false;
+		queue_metadata->credit--;
+		atomic_inc(&queue_metadata->active_workers);
+		queue = queue_metadata->self;
+	}
+	spin_unlock(&pool->lock);
+	/* Before looking at the rings, see kick_workers(). */
+	if (queue)
+		smp_mb();
+	return queue;
+}
+
+/*
+ * Done with a context from next_runnable(), after running a submission off it
+ * if @ran. Not having found one (nothing left, or no room for its event) it
+ * waits for the process to kick it again, unless it already did and was
+ * turned away for max_workers, see kick_workers(). Either way the workers
+ * count as idle on it until it is queued again.
+ */
+static void
+finish_runnable(struct buffer_slab *queue, bool ran)
+{
+	struct queue_metadata *queue_metadata = to_queue_metadata(queue);
+
+	atomic_dec(&queue_metadata->active_workers);
+	set_workers_idle(queue_metadata);
+	smp_mb();
+	/* It may have been held back for max_workers, or got more meanwhile. */
+	if (ran || (queue_metadata->max_workers && xchg(&queue_metadata->kick_missed, false)))
+		kick_workers(queue);
+	put_async_queue(queue);
+}
+
+/* Leave the address space the worker is in, if any. */
+static void
+worker_unuse_mm(struct worker *worker)
+{
+	if (!worker->mm)
+		return;
+	set_fs(worker->fs);
+	unuse_mm(worker->mm);
+	mmput(worker->mm);
+	worker->mm = NULL;
+}
+
+/*
+ * Move into the context's address space, so user pointers in the arguments
+ * resolve. Nothing to do when the worker is still in it from the last
+ * submission, which is the point of keeping it.
+ */
+static int
+worker_use_mm(struct worker *worker, struct queue_metadata *queue_metadata)
+{
+	if (worker->mm == queue_metadata->mm)
+		return 0;
+	worker_unuse_mm(worker);
+
+	if (!mmget_not_zero(queue_metadata->mm))
+		return -ESRCH;
+	use_mm(queue_metadata->mm);
+	worker->fs = get_fs();
+	set_fs(USER_DS);
+	worker->mm = queue_metadata->mm;
+	return 0;
+}
+
+/*
+ * Share the task's root, working directory and umask, as a thread created
+ * with CLONE_FS would. Not while it is in the middle of an execve(), which
+ * is about to unshare them.
+ */
+static int
+get_task_fs(struct task_struct *task, struct fs_struct **fs)
+{
+	int err = 0;
+
+	task_lock(task);
+	if (!(*fs = task->fs)) {
+		err = -ESRCH;
+	} else {
+		spin_lock(&(*fs)->lock);
+		if ((*fs)->in_exec)
+			err = -EAGAIN;
+		else
+			(*fs)->users++;
+		spin_unlock(&(*fs)->lock);
+	}
+	task_unlock(task);
+	return err;
+}
+
+static void
+put_fs(struct fs_struct *fs)
+{
+	bool last;
+
+	spin_lock(&fs->lock);
+	last = !--fs->users;
+	spin_unlock(&fs->lock);
+	if (last)
+		free_fs_struct_fn(fs);
+}
+
+/*
+ * Become the process which set up the context: its address space (so user
+ * pointers in the arguments resolve), its open files (so fds do), its root
+ * and working directory (so paths do, in its mount namespace) and its
+ * credentials (so permission checks are its own). Only the address space is
+ * kept afterwards.
+ */
+static int
+attach_submitter(struct worker *worker, struct queue_metadata *queue_metadata,
+		struct submitter_state *saved)
+{
+	struct files_struct *files;
+	struct fs_struct *fs;
+	int err;
+
+	if ((err = worker_use_mm(worker, queue_metadata)))
+		return err;
+	if (!(files = get_files_struct(queue_metadata->task)))
+		return -ESRCH;
+	if ((err = get_task_fs(queue_metadata->task, &fs))) {
+		put_files_struct(files);
+		return err;
+	}
+
+	task_lock(current);
+	saved->files = current->files;
+	current->files = files;
+	saved->fs = current->fs;
+	current->fs = fs;
+	task_unlock(current);
+
+	saved->cred = override_creds(queue_metadata->cred);
+	return 0;
+}
+
+static void
+detach_submitter(struct submitter_state *saved)
+{
+	struct files_struct *files;
+	struct fs_struct *fs;
+
+	revert_creds(saved->cred);
+
+	task_lock(current);
+	files = current->files;
+	current->files = saved->files;
+	fs = current->fs;
+	current->fs = saved->fs;
+	task_unlock(current);
+	put_files_struct(files);
+	put_fs(fs);
+}
+
+static long
+run_call(struct queue_metadata *queue_metadata, const struct async_cb *cb)
+{
+	if (is_fixed_op(cb->number))
+		return do_fixed_op(queue_metadata, cb->number, cb->args);
+	return do_async_syscall(cb->number, cb->args);
+}
+
+/* Whether the context lets cb be run at all, see AS_SYS_SETUP_ALLOWLIST. */
+static long
+check_call(struct queue_metadata *queue_metadata, const struct async_cb *cb)
+{
+	if (is_fixed_op(cb->number))
+		return 0;
+	if (!syscall_supported(cb->number))
+		return -ENOSYS;
+	if (queue_metadata->allowed && !test_bit(cb->number, queue_metadata->allowed))
+		return -EPERM;
+	return 0;
+}
+
+/* Interrupt the worker's call, with worker->lock held. */
+static void
+interrupt_call(struct worker *worker)
+{
+	/*
+	 * SIGKILL rather than something milder so that killable sleeps (NFS
+	 * and most of the block layer) give up as well.
+	 */
+	send_sig(SIGKILL, worker->thread, 1);
+}
+
+static void
+call_timeout(struct timer_list *timer)
+{
+	struct worker *worker = from_timer(worker, timer, timer);
+
+	spin_lock(&worker->lock);
+	if (worker->calling) {
+		worker->timed_out = true;
+		interrupt_call(worker);
+	}
+	spin_unlock(&worker->lock);
+}
+
+/*
+ * Run cb, the worker's cbs[i], unless it was canceled meanwhile. Interrupted
+ * calls which failed report why they were interrupted, one which got done
+ * anyway reports its result.
+ */
+static long
+run_link(struct worker *worker, struct queue_metadata *queue_metadata, size_t i)
+{
+	const struct async_cb *cb = &worker->cbs[i];
+	bool canceled, timed_out;
+	u64 start;
+	long res;
+
+	spin_lock_bh(&worker->lock);
+	worker->cur = i;
+	canceled = cb->flags & AS_SYS_CB_CANCELED;
+	worker->calling = !canceled;
+	worker->canceled = worker->timed_out = false;
+	spin_unlock_bh(&worker->lock);
+	if (canceled)
+		return -ECANCELED;
+
+	if ((cb->flags & AS_SYS_CB_TIMEOUT) && queue_metadata->cb_timeout)
+		mod_timer(&worker->timer, jiffies + queue_metadata->cb_timeout);
+	start = ktime_get_ns();
+	res = run_call(queue_metadata, cb);
+	this_cpu_add(queue_metadata->stats->busy_ns, ktime_get_ns() - start);
+	del_timer_sync(&worker->timer);
+
+	spin_lock_bh(&worker->lock);
+	worker->calling = false;
+	worker->cur = i + 1;
+	canceled = worker->canceled;
+	timed_out = worker->timed_out;
+	spin_unlock_bh(&worker->lock);
+
+	/* Nobody sends any more, don't let it hit the next call. */
+	if (canceled || timed_out)
+		flush_signals(current);
+	if (res < 0 && timed_out)
+		return -ETIME;
+	if (res < 0 && canceled)
+		return -ECANCELED;
+	return res;
+}
+
+/*
+ * Run the submission and, for AS_SYS_CB_LINK, the rest of its chain, out of
+ * worker->cbs. The event of the first was reserved by try_get_submission(),
+ * each link past it reserves its own before it is run.
+ */
+static void
+run_submission(struct worker *worker, struct buffer_slab *queue, size_t nr)
+{
+	struct queue_metadata *queue_metadata = to_queue_metadata(queue);
+	const struct async_cb *cbs = worker->cbs;
+	struct async_event event;
+	struct submitter_state saved;
+	u64 dispatched = ktime_get_ns();
+	long err, cancel = 0;
+	size_t i;
+
+	spin_lock_bh(&worker->lock);
+	worker->running = queue_metadata;
+	worker->cur = 0;
+	worker->nr = nr;
+	spin_unlock_bh(&worker->lock);
+
+	err = attach_submitter(worker, queue_metadata, &saved);
+
+	for (i = 0; i < nr; i++) {
+		if (i && !reserve_event(queue))
+			break;
+		event.user_data = cbs[i].user_data;
+		event.res = err ? err : cancel;
+		if (!event.res)
+			event.res = check_call(queue_metadata, &cbs[i]);
+		if (!event.res)
+			event.res = run_link(worker, queue_metadata, i);
+		post_event(queue, &event, dispatched);
+
+		/* A failed step takes the rest of the chain down with it. */
+		if (event.res < 0)
+			cancel = -ECANCELED;
+		cond_resched();
+	}
+
+	if (!err)
+		detach_submitter(&saved);
+
+	spin_lock_bh(&worker->lock);
+	worker->running = NULL;
+	spin_unlock_bh(&worker->lock);
+}
+
+/**
+ * try_run_inline() - Run an AS_SYS_CB_INLINE call in the submitting process
+ * @queue		A queue pinned with get_async_queue()
+ * @cb			The call, copied in from the process
+ *
+ * The submitter already is the process the workers would become, so the call
+ * is run and its event posted right here, skipping the wakeup of a worker
+ * and the trip of the cb and its event to another cpu. Only with the same
+ * address space and files though, and only if it can't block, see
+ * try_inline_syscall().
+ *
+ * Return:		true if the event was posted, false if the call has to
+ *			go to the workers.
+ */
+int
+try_run_inline(struct buffer_slab *queue, const struct async_cb *cb)
+{
+	struct queue_metadata *queue_metadata = to_queue_metadata(queue);
+	const struct cred *saved_cred;
+	struct async_event event;
+	u64 dispatched;
+	bool same_files;
+
+	if (queue_metadata->dead || current->mm != queue_metadata->mm ||
+	    is_fixed_op(cb->number))
+		return false;
+	task_lock(queue_metadata->task);
+	same_files = queue_metadata->task->files == current->files;
+	task_unlock(queue_metadata->task);
+	if (!same_files || !try_reserve_event(queue_metadata))
+		return false;
+
+	dispatched = ktime_get_ns();
+	event.user_data = cb->user_data;
+	event.res = cb->flags & AS_SYS_CB_CANCELED ? -ECANCELED : check_call(queue_metadata, cb);
+	if (!event.res) {
+		/* The process' credentials may have changed since the setup. */
+		saved_cred = override_creds(queue_metadata->cred);
+		event.res = try_inline_syscall(cb->number, cb->args);
+		revert_creds(saved_cred);
+		if (event.res == -EAGAIN) {
+			unreserve_event(queue_metadata);
+			return false;
+		}
+	}
+
+	this_cpu_inc(queue_metadata->stats->submitted);
+	this_cpu_inc(queue_metadata->stats->inlined);
+	post_event(queue, &event, dispatched);
+	return true;
+}
+
+/* Look for the call among what the worker has left of its chain. */
+static int
+cancel_worker_call(struct worker *worker, struct queue_metadata *queue_metadata,
+		__u64 user_data)
+{
+	int ret = -ENOENT;
+	size_t i;
+
+	spin_lock_bh(&worker->lock);
+	if (worker->running != queue_metadata)
+		goto out;
+	for (i = worker->cur; i < worker->nr; i++) {
+		if (worker->cbs[i].user_data != user_data)
+			continue;
+		if (i == worker->cur && worker->calling) {
+			worker->canceled = true;
+			interrupt_call(worker);
+			ret = -EALREADY;
+		} else {
+			/* run_link() looks at the flag under the lock. */
+			worker->cbs[i].flags |= AS_SYS_CB_CANCELED;
+			ret = 0;
+		}
+		break;
+	}
+out:
+	spin_unlock_bh(&worker->lock);
+	return ret;
+}
+
+/**
+ * cancel_running() - Cancel a call one of the workers took off the context's ring
+ *
+ * Return:		0 if the call was still waiting for its turn in a chain,
+ *			-EALREADY if it was running and has been interrupted,
+ *			-ENOENT if no worker has it (anymore).
+ */
+int
+cancel_running(struct queue_metadata *queue_metadata, __u64 user_data)
+{
+	struct worker_pool *pool;
+	unsigned int i;
+	int node, ret;
+
+	for (node = 0; node < nr_node_ids; node++) {
+		pool = &pools[node];
+		for (i = 0; i < pool->nr_workers; i++) {
+			ret = cancel_worker_call(pool->workers[i], queue_metadata, user_data);
+			if (ret != -ENOENT)
+				return ret;
+		}
+	}
+	return -ENOENT;
+}
+
+static int
+worker_fn(void *data)
+{
+	struct worker *worker = data;
+	struct worker_pool *pool = worker->pool;
+	struct buffer_slab *queue;
+	size_t nr, max;
+
+	/* How calls are interrupted, see interrupt_call(). */
+	allow_signal(SIGKILL);
+
+	while (!kthread_should_stop()) {
+		/* Don't keep a process' address space alive while idle. */
+		if (list_empty(&pool->runnable))
+			worker_unuse_mm(worker);
+		if (wait_event_interruptible_exclusive(pool->wait, kthread_should_stop() ||
+					!list_empty(&pool->runnable))) {
+			/*
+			 * A SIGKILL meant for a call which just ended, or sent
+			 * to us by someone else. Left pending it would end
+			 * every wait right away.
+			 */
+			flush_signals(current);
+			continue;
+		}
+
+		if (!(queue = next_runnable(pool, worker)))
+			continue;
+
+		max = min_t(size_t, AS_SYS_MAX_LINKS, to_queue_metadata(queue)->nr_events);
+		nr = try_get_submission(queue, worker->cbs, max);
+		if (!nr) {
+			/*
+			 * Say we are leaving, then look once more: a submitter
+			 * pushes before it checks the flag, so either we see
+			 * its submission or it sees the flag and notifies.
+			 */
+			set_workers_idle(to_queue_metadata(queue));
+			smp_mb();
+			nr = try_get_submission(queue, worker->cbs, max);
+		}
+		if (nr) {
+			/* Let another worker start on the rest meanwhile. */
+			kick_workers(queue);
+			run_submission(worker, queue, nr);
+		}
+		finish_runnable(queue, nr);
+		cond_resched();
+	}
+	worker_unuse_mm(worker);
+	return 0;
+}
+
+/* Start a node's share of the workers, bound to the cpus of the node. */
+static int
+start_pool(int node, unsigned int nr_threads)
+{
+	struct worker_pool *pool = &pools[node];
+	struct worker *worker;
+	unsigned int i;
+
+	pool->workers = kcalloc(nr_threads, sizeof(*pool->workers), GFP_KERNEL);
+	if (!pool->workers)
+		return false;
+
+	for (i = 0; i < nr_threads; i++) {
+		if (!(worker = kvmalloc_node(sizeof(*worker), GFP_KERNEL, node)))
+			return false;
+		worker->pool = pool;
+		spin_lock_init(&worker->lock);
+		worker->running = NULL;
+		worker->calling = false;
+		worker->mm = NULL;
+		worker->affinity_run = 0;
+		timer_setup(&worker->timer, call_timeout, 0);
+		worker->thread = kthread_create_on_node(worker_fn, worker, node,
+				"as_sys_worker/%d:%u", node, i);
+		if (IS_ERR(worker->thread)) {
+			mpr_err("Unable to start worker %u on node %d\n", i, node);
+			kvfree(worker);
+			return false;
+		}
+		set_cpus_allowed_ptr(worker->thread, cpumask_of_node(node));
+		pool->workers[pool->nr_workers++] = worker;
+		wake_up_process(worker->thread);
+	}
+	return true;
+}
+
+int
+init_workers(void)
+{
+	unsigned int nr_cpus = num_online_cpus();
+	unsigned int node_cpus, total = 0;
+	int node;
+
+	if (!nr_workers)
+		nr_workers = nr_cpus;
+
+	free_fs_struct_fn = (void *)kallsyms_lookup_name("free_fs_struct");
+	if (!free_fs_struct_fn) {
+		mpr_err("Unable to find free_fs_struct\n");
+		return false;
+	}
+
+	pools = kcalloc(nr_node_ids, sizeof(*pools), GFP_KERNEL);
+	if (!pools)
+		return false;
+
+	for (node = 0; node < nr_node_ids; node++) {
+		spin_lock_init(&pools[node].lock);
+		INIT_LIST_HEAD(&pools[node].runnable);
+		init_waitqueue_head(&pools[node].wait);
+	}
+
+	for_each_online_node(node) {
+		node_cpus = cpumask_weight(cpumask_of_node(node));
+		if (!node_cpus)
+			continue;
+		/* Every node with cpus gets at least one worker. */
+		if (!start_pool(node, max(1U, nr_workers * node_cpus / nr_cpus))) {
+			deinit_workers();
+			return false;
+		}
+		if (!fallback_pool)
+			fallback_pool = &pools[node];
+		total += pools[node].nr_workers;
+	}
+
+	mpr_info("Started %u workers\n", total);
+	return true;
+}
+
+/*
+ * Drop the run list's references of the contexts still on it once no worker
+ * is left to take them. Their files are gone (nothing else keeps the module
+ * in), so nobody waits on what they had queued.
+ */
+static void
+drain_pool(struct worker_pool *pool)
+{
+	struct queue_metadata *queue_metadata;
+
+	spin_lock(&pool->lock);
+	while (!list_empty(&pool->runnable)) {
+		queue_metadata = list_first_entry(&pool->runnable,
+				struct queue_metadata, run_list);
+		list_del_init(&queue_metadata->run_list);
+		queue_metadata->queued = false;
+		spin_unlock(&pool->lock);
+		put_async_queue(queue_metadata->self);
+		spin_lock(&pool->lock);
+	}
+	spin_unlock(&pool->lock);
+}
+
+void
+deinit_workers(void)
+{
+	struct worker_pool *pool;
+	unsigned int i;
+	int node;
+
+	for (node = 0; node < nr_node_ids; node++) {
+		pool = &pools[node];
+		for (i = 0; i < pool->nr_workers; i++) {
+			kthread_stop(pool->workers[i]->thread);
+			kvfree(pool->workers[i]);
+		}
+		kfree(pool->workers);
+		drain_pool(pool);
+	}
+
+	kfree(pools);
+	pools = NULL;
+	fallback_pool = NULL;
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2017 Sean Wilson <spwilson2@wisc.edu>
+ *
+ * This file is released under the GPLv2
+ */
+
+#ifndef __MODULE_SRC_WORKER_H
+#define __MODULE_SRC_WORKER_H
+
+#include <linux/types.h>
+#include "buffer.h"
+
+/* Start the pool of kernel threads executing submitted syscalls. */
+int init_workers(void);
+void deinit_workers(void);
+
+/*
+ * Let the pool know the context may have new submissions. Cheap when there
+ * is nothing queued or the context is already waiting for a worker.
+ */
+void kick_workers(struct buffer_slab *queue);
+
+struct queue_metadata;
+struct async_cb;
+
+/*
+ * Run an AS_SYS_CB_INLINE call right away if it can't block in the
+ * submitter, posting its event. Returns false if it's the workers' to run.
+ */
+int try_run_inline(struct buffer_slab *queue, const struct async_cb *cb);
+
+/*
+ * Cancel a call of the context a worker took. Returns 0 if it hadn't been
+ * started yet, -EALREADY if it was interrupted and -ENOENT if no worker has
+ * it.
+ */
+int cancel_running(struct queue_metadata *queue_metadata, __u64 user_data);
+
+#endif
@@ -1,113 +1,663 @@
 #ifdef _LINUX_
 #include <linux/stddef.h>
+#include <linux/string.h>
+#include <linux/jiffies.h>
+#include <linux/wait_bit.h>
 #else
 #include <string.h>
 #include <stddef.h>
-#include "mutex.h"
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #endif
 
 #include "asm_primitives.h"
 #include "circle_buffer.h"
 
-static inline size_t increment_idx(size_t idx, size_t size) {
-	idx += 1;
-	return  idx < size ? idx : 0;
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define claim_idx(p, expected, desired) \
+	__atomic_compare_exchange_n((p), (expected), (desired), true, \
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED)
+
+#ifdef _LINUX_
+static inline void cb_sleep(volatile unsigned int *word, unsigned int val) {
+	wait_var_event_timeout((void*)word, READ_ONCE(*word) != val,
+			msecs_to_jiffies(CB_SLEEP_MS));
 }
 
-int init_buffer(circle_buffer* buf, size_t data_size, size_t enteries) {
+static inline void cb_wake(volatile unsigned int *word) {
+	wake_up_var((void*)word);
+}
+#else
+/* Not FUTEX_PRIVATE_FLAG, rings are usually shared with someone. */
+static inline void cb_sleep(volatile unsigned int *word, unsigned int val) {
+	struct timespec timeout = { 0, CB_SLEEP_MS * 1000000L };
+
+	syscall(SYS_futex, word, FUTEX_WAIT, val, &timeout, NULL, 0);
+}
+
+static inline void cb_wake(volatile unsigned int *word) {
+	syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+#endif
+
+/*
+ * Called after making progress the other side may be sleeping on. The fence
+ * pairs with the one in prepare_sleep(): either we see the sleeper or it sees
+ * what we did to the ring.
+ */
+static inline void wake_waiters(circle_buffer *buf, struct cb_wait *wait) {
+	if (buf->layout & CB_WAIT_SPIN)
+		return;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (wait->waiters) {
+		__atomic_add_fetch(&wait->word, 1, __ATOMIC_RELAXED);
+		cb_wake(&wait->word);
+	}
+}
+
+static inline unsigned int prepare_sleep(struct cb_wait *wait) {
+	unsigned int val = wait->word;
+
+	__atomic_add_fetch(&wait->waiters, 1, __ATOMIC_SEQ_CST);
+	return val;
+}
+
+static inline void finish_sleep(struct cb_wait *wait) {
+	__atomic_sub_fetch(&wait->waiters, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Retry `attempt` until it succeeds. Spin on it for CB_SPIN_TRIES, then
+ * announce ourselves on `wait` and retry once more before sleeping so that a
+ * wakeup can't slip in between the last attempt and the sleep.
+ */
+#define wait_until(buf, wait, attempt) do {				\
+	unsigned int __spins = 0, __val;				\
+									\
+	for (;;) {							\
+		if (attempt)						\
+			break;						\
+		if (((buf)->layout & CB_WAIT_SPIN) ||			\
+		    __spins++ < CB_SPIN_TRIES) {			\
+			__asm_pause();					\
+			continue;					\
+		}							\
+		__val = prepare_sleep(wait);				\
+		if (attempt) {						\
+			finish_sleep(wait);				\
+			break;						\
+		}							\
+		cb_sleep(&(wait)->word, __val);				\
+		finish_sleep(wait);					\
+	}								\
+} while (0)
+
+static inline size_t round_up_pow2(size_t n) {
+	size_t size = 1;
+
+	while (size < n)
+		size <<= 1;
+	return size;
+}
+
+static inline size_t *slot_seq(circle_buffer *buf, const struct cb_geometry *geo,
+		size_t idx) {
+	return (size_t*)buf->buffer + idx;
+}
+
+static inline size_t align_up(size_t n, size_t align) {
+	return (n + align - 1) & ~(align - 1);
+}
+
+/* The elements follow the sequence numbers. */
+static inline char *slot_data(circle_buffer *buf, const struct cb_geometry *geo,
+		size_t idx) {
+	return buf->buffer + geo->data_offset + geo->stride * idx;
+}
+
+/*
+ * Whether the ring has no room at position tail, going by the producers' last
+ * look at head_idx first. head_cache never runs ahead of head_idx, so room
+ * from it is room for sure and only its absence calls for reading head_idx
+ * off the consumers' line. An opposite index read after ours may be past it,
+ * hence the signed differences.
+ */
+static inline bool ring_full(circle_buffer *buf, const struct cb_geometry *geo,
+		size_t tail) {
+	size_t head;
+
+	if ((long)(tail - buf->head_cache) <= (long)geo->mask)
+		return false;
+	head = load_acquire(&buf->head_idx);
+	buf->head_cache = head;
+	return (long)(tail - head) > (long)geo->mask;
+}
+
+/* The same for consumers with tail_cache, nothing to take at position head. */
+static inline bool ring_empty(circle_buffer *buf, size_t head) {
+	size_t tail;
+
+	if ((long)(buf->tail_cache - head) > 0)
+		return false;
+	tail = load_acquire(&buf->tail_idx);
+	buf->tail_cache = tail;
+	return (long)(tail - head) <= 0;
+}
+
+static inline void read_geometry(circle_buffer *buf, struct cb_geometry *geo) {
+	geo->mask = buf->mask;
+	geo->data_size = buf->data_size;
+	geo->stride = buf->stride;
+	geo->data_offset = buf->data_offset;
+}
+
+static void layout_geometry(size_t data_size, size_t entries, unsigned int layout,
+		struct cb_geometry *geo) {
+	size_t size = round_up_pow2(entries);
+
+	geo->mask = size - 1;
+	geo->data_size = data_size;
+	geo->stride = data_size;
+	geo->data_offset = sizeof(size_t) * size;
+
+	if (layout & CB_LAYOUT_ALIGNED) {
+		// Smaller elements pack a line evenly, larger ones start on one.
+		// Sequence numbers stay packed, a line each would cost more than
+		// the slot itself for small elements.
+		geo->stride = data_size < CB_CACHELINE ? round_up_pow2(data_size) :
+			align_up(data_size, CB_CACHELINE);
+		geo->data_offset = align_up(geo->data_offset, CB_CACHELINE);
+	}
+}
+
+size_t circle_buffer_size_layout(size_t data_size, size_t entries, unsigned int layout) {
+	struct cb_geometry geo;
+
+	layout_geometry(data_size, entries, layout, &geo);
+	return sizeof(circle_buffer) + geo.data_offset + geo.stride * (geo.mask + 1);
+}
+
+size_t circle_buffer_size(size_t data_size, size_t entries) {
+	return circle_buffer_size_layout(data_size, entries, 0);
+}
+
+int init_buffer_layout(circle_buffer* buf, size_t data_size, size_t enteries,
+		unsigned int layout) {
+	struct cb_geometry geo;
+	size_t idx;
+
 	if (!buf)
 		return false;
-	buf->data_size = data_size;
-	buf->size = enteries;
+	layout_geometry(data_size, enteries, layout, &geo);
+	buf->data_size = geo.data_size;
+	buf->size = geo.mask + 1;
+	buf->mask = geo.mask;
+	buf->stride = geo.stride;
+	buf->data_offset = geo.data_offset;
+	buf->layout = layout;
 	buf->head_idx = buf->tail_idx = 0;
-	mutex_init(&buf->tail_lock);
-	return false;
+	buf->head_cache = buf->tail_cache = 0;
+	buf->not_empty.word = buf->not_empty.waiters = 0;
+	buf->not_full.word = buf->not_full.waiters = 0;
+	buf->flags = 0;
+	for (idx = 0; idx < buf->size; idx++)
+		*slot_seq(buf, &geo, idx) = idx;
+	return true;
 }
 
-/* Insert the given `void *` into the circular_buffer, may block if no space.. */
-void push(circle_buffer* buf, void* data_p) {
-	size_t oldtail, newtail;
-
-	///////
-	// Producers will grab a lock in order to solve queue ABA problems...
-	//
-	// (SEE: https://en.wikipedia.org/wiki/ABA_problem )
-	//
-	// The race condition that occurs in this ABA problem is that the whole
-	// queue may loop around to this same location but the head might have
-	// moved to now be in front of us and we would overwrite it. (It would
-	// appear like the head to magically moved backwards, when in reality
-	// we wrapped around the queue and thus ABA.)
-	///////
+int init_buffer(circle_buffer* buf, size_t data_size, size_t enteries) {
+	return init_buffer_layout(buf, data_size, enteries, 0);
+}
+
+void get_geometry(circle_buffer *buf, struct cb_geometry *geo) {
+	read_geometry(buf, geo);
+}
+
+int try_push_geo(circle_buffer* buf, const struct cb_geometry *geo, void* data_p) {
+	size_t pos = buf->tail_idx, seq, *seqp;
+	long diff;
+
+	if (ring_full(buf, geo, pos))
+		return false;
 	for(;;) {
-		// Spin until we can fit anything...
-		while(is_full(buf))
-			__asm_pause();
+		seqp = slot_seq(buf, geo, pos & geo->mask);
+		seq = load_acquire(seqp);
+		diff = (long)(seq - pos);
+
+		if (diff == 0) {
+			// The slot is free for this lap, race the other producers for it.
+			// A failed claim reloads pos with the winner's update.
+			if (claim_idx(&buf->tail_idx, &pos, pos + 1))
+				break;
+		} else if (diff < 0) {
+			// The consumer of the previous lap hasn't given it back, full.
+			return false;
+		} else {
+			// Another producer got here first.
+			pos = buf->tail_idx;
+		}
+	}
+
+	memcpy(slot_data(buf, geo, pos & geo->mask), data_p, geo->data_size);
+	store_release(seqp, pos + 1);
+	wake_waiters(buf, &buf->not_empty);
+	return true;
+}
 
-		// We are now holding the lock, reconfirm we will fit.
-		mutex_lock(&buf->tail_lock);
+int try_pop_geo(circle_buffer* buf, const struct cb_geometry *geo, void* dest_p) {
+	size_t pos = buf->head_idx, seq, *seqp;
+	long diff;
+
+	if (ring_empty(buf, pos))
+		return false;
+	for(;;) {
+		seqp = slot_seq(buf, geo, pos & geo->mask);
+		seq = load_acquire(seqp);
+		diff = (long)(seq - (pos + 1));
 
-		if (is_full(buf)) {
-			mutex_unlock(&buf->tail_lock);
-			continue;
+		if (diff == 0) {
+			if (claim_idx(&buf->head_idx, &pos, pos + 1))
+				break;
+		} else if (diff < 0) {
+			// Nothing published here yet, empty.
+			return false;
+		} else {
+			pos = buf->head_idx;
 		}
+	}
+
+	memcpy(dest_p, slot_data(buf, geo, pos & geo->mask), geo->data_size);
+	// Hand the slot to whoever produces `size` positions from now.
+	store_release(seqp, pos + geo->mask + 1);
+	wake_waiters(buf, &buf->not_full);
+	return true;
+}
+
+/*
+ * Move n elements starting at position pos between the ring and a flat array.
+ * Packed slots take one memcpy, or two when the range wraps around.
+ */
+static void copy_slots(circle_buffer *buf, const struct cb_geometry *geo, size_t pos,
+		char *flat, size_t n, bool to_ring) {
+	size_t idx = pos & geo->mask, first, i;
+	char *slot;
 
-		oldtail = buf->tail_idx;
-		newtail = increment_idx(oldtail, buf->size);
+	if (geo->stride != geo->data_size) {
+		for (i = 0; i < n; i++, flat += geo->data_size) {
+			slot = slot_data(buf, geo, (pos + i) & geo->mask);
+			if (to_ring)
+				memcpy(slot, flat, geo->data_size);
+			else
+				memcpy(flat, slot, geo->data_size);
+		}
+		return;
+	}
 
-		// Place the data. (We have to do this with the lock to avoid race
-		// conditions with the head. To reduce contention we could use a shadow
-		// tail as well.)
-		memcpy(buf->buffer + buf->data_size * oldtail, data_p, buf->data_size);
-		buf->tail_idx = newtail;
-		mutex_unlock(&buf->tail_lock);
-		break;
+	first = geo->mask + 1 - idx;
+	if (first > n)
+		first = n;
+	if (to_ring) {
+		memcpy(slot_data(buf, geo, idx), flat, first * geo->data_size);
+		memcpy(slot_data(buf, geo, 0), flat + first * geo->data_size,
+				(n - first) * geo->data_size);
+	} else {
+		memcpy(flat, slot_data(buf, geo, idx), first * geo->data_size);
+		memcpy(flat + first * geo->data_size, slot_data(buf, geo, 0),
+				(n - first) * geo->data_size);
 	}
 }
 
+/*
+ * Slots once free for our lap stay that way until their position is claimed,
+ * so checking them all before the claim is enough to own the whole range.
+ */
+size_t try_push_n_geo(circle_buffer* buf, const struct cb_geometry *geo,
+		void* src_p, size_t n) {
+	size_t pos = buf->tail_idx, nr, i;
+	long diff;
+
+	if (!n || ring_full(buf, geo, pos))
+		return 0;
+	if (n > geo->mask + 1)
+		n = geo->mask + 1;
+	for(;;) {
+		for (nr = 0; nr < n; nr++) {
+			diff = (long)(load_acquire(slot_seq(buf, geo, (pos + nr) & geo->mask)) -
+					(pos + nr));
+			if (diff)
+				break;
+		}
+
+		if (nr) {
+			if (claim_idx(&buf->tail_idx, &pos, pos + nr))
+				break;
+		} else if (diff < 0) {
+			return 0;
+		} else {
+			pos = buf->tail_idx;
+		}
+	}
+
+	copy_slots(buf, geo, pos, src_p, nr, true);
+	for (i = 0; i < nr; i++)
+		store_release(slot_seq(buf, geo, (pos + i) & geo->mask), pos + i + 1);
+	wake_waiters(buf, &buf->not_empty);
+	return nr;
+}
+
+size_t try_pop_n_geo(circle_buffer* buf, const struct cb_geometry *geo,
+		void* dest_p, size_t max) {
+	size_t pos = buf->head_idx, nr, i;
+	long diff;
+
+	if (!max || ring_empty(buf, pos))
+		return 0;
+	if (max > geo->mask + 1)
+		max = geo->mask + 1;
+	for(;;) {
+		for (nr = 0; nr < max; nr++) {
+			diff = (long)(load_acquire(slot_seq(buf, geo, (pos + nr) & geo->mask)) -
+					(pos + nr + 1));
+			if (diff)
+				break;
+		}
+
+		if (nr) {
+			if (claim_idx(&buf->head_idx, &pos, pos + nr))
+				break;
+		} else if (diff < 0) {
+			return 0;
+		} else {
+			pos = buf->head_idx;
+		}
+	}
+
+	copy_slots(buf, geo, pos, dest_p, nr, false);
+	for (i = 0; i < nr; i++)
+		store_release(slot_seq(buf, geo, (pos + i) & geo->mask),
+				pos + i + geo->mask + 1);
+	wake_waiters(buf, &buf->not_full);
+	return nr;
+}
+
+/*
+ * Like try_pop_n_geo(), except that only the elements are taken up to the
+ * first one which isn't `linked` to the element after it. Elements are
+ * looked at before the claim, which only succeeds if nobody else moved the
+ * head meanwhile, so what was looked at is what gets copied out.
+ */
+size_t try_pop_run_geo(circle_buffer* buf, const struct cb_geometry *geo,
+		void* dest_p, size_t max, int (*linked)(const void *elem)) {
+	size_t pos = buf->head_idx, nr, i;
+	bool complete;
+	long diff = 0;
+
+	if (!max || ring_empty(buf, pos))
+		return 0;
+	if (max > geo->mask + 1)
+		max = geo->mask + 1;
+	for(;;) {
+		complete = false;
+		for (nr = 0; nr < max && !complete; nr++) {
+			diff = (long)(load_acquire(slot_seq(buf, geo, (pos + nr) & geo->mask)) -
+					(pos + nr + 1));
+			if (diff)
+				break;
+			complete = !linked(slot_data(buf, geo, (pos + nr) & geo->mask));
+		}
+
+		if (complete || nr == max) {
+			if (claim_idx(&buf->head_idx, &pos, pos + nr))
+				break;
+		} else if (diff < 0) {
+			// Empty, or the end of the run isn't published yet.
+			return 0;
+		} else {
+			pos = buf->head_idx;
+		}
+	}
+
+	copy_slots(buf, geo, pos, dest_p, nr, false);
+	for (i = 0; i < nr; i++)
+		store_release(slot_seq(buf, geo, (pos + i) & geo->mask),
+				pos + i + geo->mask + 1);
+	wake_waiters(buf, &buf->not_full);
+	return nr;
+}
+
+/*
+ * The producers' side of try_pop_run_geo(): claim room for as many of the
+ * first runs as fit whole, all with one index update. The free slots are
+ * counted before the claim as in try_push_n_geo(), then cut back to the end
+ * of the last run within them.
+ */
+size_t try_push_run_geo(circle_buffer* buf, const struct cb_geometry *geo,
+		void* src_p, size_t n, int (*linked)(const void *elem)) {
+	size_t pos = buf->tail_idx, nr, cut, i;
+	char *src = src_p;
+	long diff = 0;
+
+	if (!n || ring_full(buf, geo, pos))
+		return 0;
+	if (n > geo->mask + 1)
+		n = geo->mask + 1;
+	for(;;) {
+		for (nr = 0; nr < n; nr++) {
+			diff = (long)(load_acquire(slot_seq(buf, geo, (pos + nr) & geo->mask)) -
+					(pos + nr));
+			if (diff)
+				break;
+		}
+		for (cut = nr; cut && linked(src + (cut - 1) * geo->data_size); cut--)
+			;
+		// A run as long as the ring can't ever fit whole, it is cut.
+		if (!cut && nr == geo->mask + 1)
+			cut = nr;
+
+		if (cut) {
+			if (claim_idx(&buf->tail_idx, &pos, pos + cut))
+				break;
+		} else if (nr == n || diff < 0) {
+			// Nothing but an unfinished run, or no room for the first.
+			return 0;
+		} else {
+			pos = buf->tail_idx;
+		}
+	}
+
+	copy_slots(buf, geo, pos, src, cut, true);
+	for (i = 0; i < cut; i++)
+		store_release(slot_seq(buf, geo, (pos + i) & geo->mask), pos + i + 1);
+	wake_waiters(buf, &buf->not_empty);
+	return cut;
+}
+
+void *peek_slot_geo(circle_buffer* buf, const struct cb_geometry *geo, size_t pos) {
+	if (load_acquire(slot_seq(buf, geo, pos & geo->mask)) != pos + 1)
+		return NULL;
+	return slot_data(buf, geo, pos & geo->mask);
+}
+
+/*
+ * Nobody else claims positions off the head, so there is nothing to race
+ * with: move it past the slots first, as a pop's claim would, then release
+ * them for the next lap.
+ */
+size_t advance_head_geo(circle_buffer* buf, const struct cb_geometry *geo, size_t n) {
+	size_t pos = buf->head_idx, nr, i;
+
+	if (n > geo->mask + 1)
+		n = geo->mask + 1;
+	for (nr = 0; nr < n; nr++)
+		if (load_acquire(slot_seq(buf, geo, (pos + nr) & geo->mask)) != pos + nr + 1)
+			break;
+	if (!nr)
+		return 0;
+
+	store_release(&buf->head_idx, pos + nr);
+	for (i = 0; i < nr; i++)
+		store_release(slot_seq(buf, geo, (pos + i) & geo->mask),
+				pos + i + geo->mask + 1);
+	wake_waiters(buf, &buf->not_full);
+	return nr;
+}
+
+int try_push(circle_buffer* buf, void* data_p) {
+	struct cb_geometry geo;
+
+	read_geometry(buf, &geo);
+	return try_push_geo(buf, &geo, data_p);
+}
+
+int try_pop(circle_buffer* buf, void* dest_p) {
+	struct cb_geometry geo;
+
+	read_geometry(buf, &geo);
+	return try_pop_geo(buf, &geo, dest_p);
+}
+
+/* Insert the given `void *` into the circular_buffer, may block if no space.. */
+void push(circle_buffer* buf, void* data_p) {
+	struct cb_geometry geo;
+
+	read_geometry(buf, &geo);
+	wait_until(buf, &buf->not_full, try_push_geo(buf, &geo, data_p));
+}
+
 /*
  * Pop the given `void *` out of the circular_buffer and place it into the given dest
  * if there is anything to consume - will block if there is nothing to consume.
  */
 void pop(circle_buffer* buf, void* dest_p) {
-	size_t oldhead, newhead;
+	struct cb_geometry geo;
+
+	read_geometry(buf, &geo);
+	wait_until(buf, &buf->not_empty, try_pop_geo(buf, &geo, dest_p));
+}
 
-	/////
-	// The readers can remain lock free since there is only a single pivot
-	// point for them. (The head pointer)
-	/////
+size_t try_push_n(circle_buffer* buf, void* src_p, size_t n) {
+	struct cb_geometry geo;
 
-	for(;;) {
-		// Spin until we can fit anything...
-		while(is_empty(buf))
-			__asm_pause();
+	read_geometry(buf, &geo);
+	return try_push_n_geo(buf, &geo, src_p, n);
+}
 
-		oldhead = buf->head_idx;
+size_t try_pop_n(circle_buffer* buf, void* dest_p, size_t max) {
+	struct cb_geometry geo;
 
-		// Check if the head might have been emptied while we grabbed it.
-		if (is_empty(buf))
-			continue;
+	read_geometry(buf, &geo);
+	return try_pop_n_geo(buf, &geo, dest_p, max);
+}
 
-		newhead = increment_idx(oldhead, buf->size);
+size_t try_pop_run(circle_buffer* buf, void* dest_p, size_t max,
+		int (*linked)(const void *elem)) {
+	struct cb_geometry geo;
 
-		// Place the data into dest.
-		memcpy(dest_p, buf->buffer + buf->data_size * oldhead, buf->data_size);
+	read_geometry(buf, &geo);
+	return try_pop_run_geo(buf, &geo, dest_p, max, linked);
+}
 
-		if (__sync_bool_compare_and_swap(&buf->head_idx, oldhead, newhead))
-			break;
+size_t try_push_run(circle_buffer* buf, void* src_p, size_t n,
+		int (*linked)(const void *elem)) {
+	struct cb_geometry geo;
+
+	read_geometry(buf, &geo);
+	return try_push_run_geo(buf, &geo, src_p, n, linked);
+}
+
+void *peek_slot(circle_buffer* buf, size_t pos) {
+	struct cb_geometry geo;
+
+	read_geometry(buf, &geo);
+	return peek_slot_geo(buf, &geo, pos);
+}
+
+size_t advance_head(circle_buffer* buf, size_t n) {
+	struct cb_geometry geo;
+
+	read_geometry(buf, &geo);
+	return advance_head_geo(buf, &geo, n);
+}
+
+void push_n(circle_buffer* buf, void* src_p, size_t n) {
+	struct cb_geometry geo;
+	char *src = src_p;
+	size_t nr;
+
+	read_geometry(buf, &geo);
+	while (n) {
+		wait_until(buf, &buf->not_full,
+				(nr = try_push_n_geo(buf, &geo, src, n)));
+		src += nr * geo.data_size;
+		n -= nr;
 	}
 }
 
+void pop_n(circle_buffer* buf, void* dest_p, size_t max, size_t *got) {
+	struct cb_geometry geo;
+
+	*got = 0;
+	if (!max)
+		return;
+	read_geometry(buf, &geo);
+	wait_until(buf, &buf->not_empty,
+			(*got = try_pop_n_geo(buf, &geo, dest_p, max)));
+}
+
 /*
- * Will check the queue to see if there is anything remaining in the queue.
+ * Positions are claimed before their slot is filled or emptied, so this counts
+ * elements still being copied in as present and ones being copied out as gone.
  */
-inline int is_empty(circle_buffer* buf) {
-	return buf->head_idx == buf->tail_idx;
+size_t count_entries_geo(circle_buffer *buf, const struct cb_geometry *geo) {
+	size_t head = load_acquire(&buf->head_idx);
+	size_t tail = load_acquire(&buf->tail_idx);
+	size_t count = tail - head;
+
+	// Pops and pushes landing between the two reads can make this overshoot,
+	// a corrupted header can make it anything at all.
+	if ((long)count < 0)
+		return 0;
+	return count > geo->mask + 1 ? geo->mask + 1 : count;
+}
+
+size_t count_entries(circle_buffer *buf) {
+	struct cb_geometry geo;
+
+	read_geometry(buf, &geo);
+	return count_entries_geo(buf, &geo);
 }
 
 /*
+ * Will check the queue to see if there is anything remaining in the queue.
  *
+ * Only goes to the producers' line for tail_idx when the last value seen there
+ * doesn't already prove there's something. The cache may be stale but tail_idx
+ * never moves backwards, so it only ever errs towards looking again.
  */
-inline int is_full(circle_buffer* buf) {
-	return increment_idx(buf->tail_idx, buf->size) == buf->head_idx;
+int is_empty(circle_buffer* buf) {
+	size_t head = buf->head_idx, tail = buf->tail_cache;
+
+	if ((long)(tail - head) > 0)
+		return false;
+	tail = buf->tail_idx;
+	buf->tail_cache = tail;
+	return head == tail;
+}
+
+/*
+ * The same for producers, head_cache never runs ahead of head_idx so a lap of
+ * room from it is room for sure.
+ */
+int is_full(circle_buffer* buf) {
+	size_t tail = buf->tail_idx, head = buf->head_cache;
+
+	if (tail - head < buf->size)
+		return false;
+	head = buf->head_idx;
+	buf->head_cache = head;
+	return tail - head >= buf->size;
 }
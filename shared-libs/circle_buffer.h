@@ -3,42 +3,190 @@
 
 
 #ifdef _LINUX_
-#include <linux/mutex.h>
+#include <linux/types.h>
 #else
 #include <stddef.h>
 #include <stdbool.h>
-#include "mutex.h"
 #endif
 
+/*
+ * A bounded multi-producer, multi-consumer queue (after Dmitry Vyukov's).
+ *
+ * Every slot carries a sequence number telling whose turn it is: a producer
+ * may fill slot `pos & mask` once its sequence is `pos`, and publishes it by
+ * setting it to `pos + 1`, a consumer may empty it once it reads `pos + 1`
+ * and hands it back for the next lap with `pos + size`. Producers and
+ * consumers therefore only contend on the CAS claiming their index, nobody
+ * holds a lock while copying their element in or out.
+ *
+ * Layout: this header, `size` sequence numbers, then `size` elements. With
+ * CB_LAYOUT_ALIGNED both arrays start on a cache line and elements are padded
+ * so that none straddles two lines, the sequence numbers stay packed. The
+ * header itself always keeps the producers' and consumers' indices on cache
+ * lines of their own.
+ *
+ * Each side also keeps its last look at the other side's index on its own
+ * line. Pushes and pops go by it to tell a full or empty ring, and only read
+ * the other side's line when it says they'd have to give up.
+ */
+#define CB_CACHELINE 64
+
+#define CB_LAYOUT_ALIGNED (1U << 0)
+/*
+ * Not a layout but picked at init time as well: push() and pop() spin on a
+ * full or empty ring no matter how long it takes, rather than going to sleep
+ * (on a futex, or a wait_var_event() in the kernel) after CB_SPIN_TRIES.
+ */
+#define CB_WAIT_SPIN (1U << 1)
+
+#define CB_SPIN_TRIES 1024
+
+/*
+ * Sleepers are only woken by the side which saw them in `waiters`, bumping
+ * `word`. Nothing can wake across the user/kernel boundary though, so they
+ * never sleep longer than CB_SLEEP_MS before looking at the ring again.
+ */
+#define CB_SLEEP_MS 1
+
+struct cb_wait {
+	volatile unsigned int word;
+	volatile unsigned int waiters;
+};
+
 typedef struct __circle_buffer {
 	size_t data_size;
-	size_t size;
+	size_t size; /* Always a power of two. */
+	size_t mask;
+	size_t stride; /* Bytes between elements. */
+	size_t data_offset; /* Of the first element from buffer. */
+	unsigned int layout;
+
+	volatile unsigned int flags; /* Free for the user of the ring, never touched here. */
 
-	struct mutex tail_lock;
-	volatile size_t tail_idx; /* The start for the producer to place data. */
-	volatile size_t head_idx; /* The beginning of a consumer list */
+	/*
+	 * Written by producers. head_cache is their last look at head_idx so
+	 * pushes and is_full() rarely have to pull in the consumers' line.
+	 */
+	volatile size_t tail_idx __attribute__((aligned(CB_CACHELINE)));
+	volatile size_t head_cache;
+	struct cb_wait not_empty; /* Consumers waiting on producers. */
 
-	char buffer[0]; /* The first address of the circular buffer. Variable length.*/
+	/* Written by consumers, likewise tail_cache for pops and is_empty(). */
+	volatile size_t head_idx __attribute__((aligned(CB_CACHELINE)));
+	volatile size_t tail_cache;
+	struct cb_wait not_full; /* Producers waiting on consumers. */
+
+	/* The first address of the circular buffer. Variable length.*/
+	char buffer[0] __attribute__((aligned(CB_CACHELINE)));
 } circle_buffer;
 
+/*
+ * What is needed to find the slots of a ring. The header may be shared with
+ * someone we don't trust (the kernel maps rings into processes), so the
+ * `_geo` variants take a copy made with get_geometry() when the ring was
+ * initialized instead of reading it from the header again.
+ */
+struct cb_geometry {
+	size_t mask;
+	size_t data_size;
+	size_t stride;
+	size_t data_offset;
+};
+
+/* Bytes needed to hold a buffer of at least `entries` elements. */
+size_t circle_buffer_size(size_t data_size, size_t entries);
+size_t circle_buffer_size_layout(size_t data_size, size_t entries, unsigned int layout);
 
+/* Entries are rounded up to a power of two, see circle_buffer_size(). */
 int init_buffer(circle_buffer* buf, size_t data_size, size_t entries);
+/* As init_buffer() with the given CB_LAYOUT_* and CB_WAIT_* flags. */
+int init_buffer_layout(circle_buffer* buf, size_t data_size, size_t entries,
+		unsigned int layout);
+
+void get_geometry(circle_buffer *buf, struct cb_geometry *geo);
 
-/* Insert the given `void *` into the circular_buffer, may block if no space.. */
+/*
+ * Insert the given `void *` into the circular_buffer, may block if no space..
+ * Unless the ring is CB_WAIT_SPIN it only spins for a while before sleeping.
+ */
 void push(circle_buffer* buf, void* val_p);
 
-/* 
+/*
  * Pop the given `void *` out of the circular_buffer if it there is anything to consume
  * will block if there is nothing to consume.
  */
 void pop(circle_buffer* buf, void* val_p);
 
-/* 
+/* Single attempt versions of push() and pop(), return true on success. */
+int try_push(circle_buffer* buf, void* val_p);
+int try_pop(circle_buffer* buf, void* val_p);
+int try_push_geo(circle_buffer* buf, const struct cb_geometry *geo, void* val_p);
+int try_pop_geo(circle_buffer* buf, const struct cb_geometry *geo, void* val_p);
+
+/*
+ * Batched versions, claiming a run of slots with a single index update.
+ * push_n() waits until all `n` elements are in, pop_n() until at least one
+ * (of at most `max`) is out, setting `got` to how many. The try_ versions
+ * return how many elements they moved.
+ */
+void push_n(circle_buffer* buf, void* src_p, size_t n);
+void pop_n(circle_buffer* buf, void* dest_p, size_t max, size_t *got);
+size_t try_push_n(circle_buffer* buf, void* src_p, size_t n);
+size_t try_pop_n(circle_buffer* buf, void* dest_p, size_t max);
+size_t try_push_n_geo(circle_buffer* buf, const struct cb_geometry *geo,
+		void* src_p, size_t n);
+size_t try_pop_n_geo(circle_buffer* buf, const struct cb_geometry *geo,
+		void* dest_p, size_t max);
+
+/*
+ * Pop a run of elements pushed together, each but the last of which `linked`
+ * is true for, taking at most `max`. A run not fully published yet is left
+ * for later, one longer than `max` is cut after `max` elements. Returns how
+ * many elements were taken.
+ */
+size_t try_pop_run(circle_buffer* buf, void* dest_p, size_t max,
+		int (*linked)(const void *elem));
+size_t try_pop_run_geo(circle_buffer* buf, const struct cb_geometry *geo,
+		void* dest_p, size_t max, int (*linked)(const void *elem));
+
+/*
+ * Push as many of the first runs of `src` (as try_pop_run() takes them) as
+ * there is room for, each of them whole or not at all. A run not finished
+ * within the first `n` elements isn't pushed, one as long as the ring is cut
+ * after that many elements. Returns how many elements were pushed.
+ */
+size_t try_push_run(circle_buffer* buf, void* src_p, size_t n,
+		int (*linked)(const void *elem));
+size_t try_push_run_geo(circle_buffer* buf, const struct cb_geometry *geo,
+		void* src_p, size_t n, int (*linked)(const void *elem));
+
+/*
+ * The element pushed at index `pos` if it is published and wasn't consumed
+ * yet, else NULL. It may be claimed by a consumer any moment, compare
+ * `pos` with head_idx afterwards to know whether it was.
+ */
+void *peek_slot(circle_buffer* buf, size_t pos);
+void *peek_slot_geo(circle_buffer* buf, const struct cb_geometry *geo, size_t pos);
+
+/*
+ * For the only consumer of a ring, which reads elements in place with
+ * peek_slot() from head_idx on: hand the first `n` slots back to the
+ * producers, as popping them would have. Stops at the first one that isn't
+ * published, returns how many were handed back.
+ */
+size_t advance_head(circle_buffer* buf, size_t n);
+size_t advance_head_geo(circle_buffer* buf, const struct cb_geometry *geo, size_t n);
+
+/* Number of elements currently waiting to be consumed. */
+size_t count_entries(circle_buffer *buf);
+size_t count_entries_geo(circle_buffer *buf, const struct cb_geometry *geo);
+
+/*
  * Will check the queue to see if there is anything remaining in the queue.
  */
-extern inline int is_empty(circle_buffer *buf);
+int is_empty(circle_buffer *buf);
 
 /* Check if there is enough space between head and tail to fit size */
-extern inline int is_full(circle_buffer *buf);
+int is_full(circle_buffer *buf);
 
 #endif
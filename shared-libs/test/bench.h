@@ -0,0 +1,58 @@
+#ifndef __SHARED_LIBS_TEST_BENCH_H
+#define __SHARED_LIBS_TEST_BENCH_H
+
+/*
+ * Timing and reporting helpers shared by the benchmarks here and in
+ * module-src/test.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *l, const void *r) {
+    uint64_t a = *(const uint64_t*)l, b = *(const uint64_t*)r;
+
+    return a < b ? -1 : a > b;
+}
+
+/* The samples must be sorted. */
+static inline uint64_t percentile(uint64_t *samples, size_t nr, double pct) {
+    size_t idx;
+
+    if (!nr)
+        return 0;
+    idx = (size_t)(pct / 100.0 * (nr - 1));
+    return samples[idx];
+}
+
+static inline void print_header(void) {
+    printf("%-28s %8s %8s %8s %8s %14s %10s %10s %10s\n", "bench", "prod",
+           "cons", "ring", "batch", "ops/s", "p50(ns)", "p99(ns)", "p999(ns)");
+}
+
+/*
+ * One line per configuration: the throughput over the whole run and the
+ * latency distribution of the samples collected.
+ */
+static inline void report(const char *name, int prod, int cons, size_t ring,
+                          size_t batch, size_t ops, uint64_t elapsed_ns,
+                          uint64_t *samples, size_t nr) {
+    qsort(samples, nr, sizeof(*samples), cmp_u64);
+    printf("%-28s %8d %8d %8zu %8zu %14.0f %10llu %10llu %10llu\n", name, prod,
+           cons, ring, batch, ops * 1e9 / (elapsed_ns ? elapsed_ns : 1),
+           (unsigned long long)percentile(samples, nr, 50),
+           (unsigned long long)percentile(samples, nr, 99),
+           (unsigned long long)percentile(samples, nr, 99.9));
+    fflush(stdout);
+}
+
+#endif
@@ -0,0 +1,131 @@
+#include "../circle_buffer.h"
+#include "bench.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Sweeps producer/consumer counts, ring sizes and batch sizes over the raw
+ * circle_buffer. Every element carries the time it was produced, consumers
+ * record how long it took to come out the other end.
+ *
+ * Usage: circle-buffer-bench [ops per configuration]
+ */
+
+#define DEFAULT_OPS 200000
+#define MAX_BATCH 64
+
+static const int threads[] = { 1, 2, 4 };
+static const size_t rings[] = { 64, 1024, 16384 };
+static const size_t batches[] = { 1, 16, MAX_BATCH };
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+struct worker {
+    pthread_t thread;
+    circle_buffer *buffer;
+    size_t quota;
+    size_t batch;
+    uint64_t *samples;
+};
+
+static void* produce(void* worker_p) {
+    struct worker *worker = worker_p;
+    uint64_t stamps[MAX_BATCH];
+    size_t left = worker->quota, nr;
+
+    while (left) {
+        nr = left < worker->batch ? left : worker->batch;
+        stamps[0] = now_ns();
+        for (size_t i = 1; i < nr; i++) {
+            stamps[i] = stamps[0];
+        }
+        if (nr == 1) {
+            push(worker->buffer, stamps);
+        } else {
+            push_n(worker->buffer, stamps, nr);
+        }
+        left -= nr;
+    }
+    return NULL;
+}
+
+static void* consume(void* worker_p) {
+    struct worker *worker = worker_p;
+    uint64_t stamps[MAX_BATCH], now;
+    size_t done = 0, got, max;
+
+    while (done < worker->quota) {
+        max = worker->quota - done < worker->batch ? worker->quota - done : worker->batch;
+        if (max == 1) {
+            pop(worker->buffer, stamps);
+            got = 1;
+        } else {
+            pop_n(worker->buffer, stamps, max, &got);
+        }
+        now = now_ns();
+        for (size_t i = 0; i < got; i++) {
+            worker->samples[done++] = now - stamps[i];
+        }
+    }
+    return NULL;
+}
+
+static int run(int prod, int cons, size_t ring, size_t batch, size_t ops) {
+    struct worker producers[prod], consumers[cons];
+    circle_buffer *buffer;
+    uint64_t *samples, start, elapsed;
+
+    // Round so that every thread gets the same share.
+    ops = ops / (prod * cons) * prod * cons;
+    buffer = malloc(circle_buffer_size_layout(sizeof(uint64_t), ring, CB_LAYOUT_ALIGNED));
+    samples = malloc(ops * sizeof(*samples));
+    if (!buffer || !samples) {
+        return 1;
+    }
+    init_buffer_layout(buffer, sizeof(uint64_t), ring, CB_LAYOUT_ALIGNED);
+
+    start = now_ns();
+    for (int i = 0; i < cons; i++) {
+        consumers[i] = (struct worker){ .buffer = buffer, .quota = ops / cons,
+            .batch = batch, .samples = samples + i * (ops / cons) };
+        if (pthread_create(&consumers[i].thread, NULL, consume, &consumers[i])) {
+            return 1;
+        }
+    }
+    for (int i = 0; i < prod; i++) {
+        producers[i] = (struct worker){ .buffer = buffer, .quota = ops / prod,
+            .batch = batch };
+        if (pthread_create(&producers[i].thread, NULL, produce, &producers[i])) {
+            return 1;
+        }
+    }
+    for (int i = 0; i < prod; i++) {
+        pthread_join(producers[i].thread, NULL);
+    }
+    for (int i = 0; i < cons; i++) {
+        pthread_join(consumers[i].thread, NULL);
+    }
+    elapsed = now_ns() - start;
+
+    report("circle_buffer", prod, cons, ring, batch, ops, elapsed, samples, ops);
+    free(samples);
+    free(buffer);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    size_t ops = argc > 1 ? strtoul(argv[1], NULL, 0) : DEFAULT_OPS;
+
+    print_header();
+    for (size_t p = 0; p < ARRAY_SIZE(threads); p++)
+        for (size_t c = 0; c < ARRAY_SIZE(threads); c++)
+            for (size_t r = 0; r < ARRAY_SIZE(rings); r++)
+                for (size_t b = 0; b < ARRAY_SIZE(batches); b++)
+                    if (run(threads[p], threads[c], rings[r], batches[b], ops)) {
+                        fprintf(stderr, "FAIL\n");
+                        return 1;
+                    }
+    return 0;
+}
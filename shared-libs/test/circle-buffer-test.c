@@ -1,8 +1,9 @@
-#include "../circle-buffer.h"
+#include "../circle_buffer.h"
 
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #define MULTIPLE_PROD_THREADS 5
 #define MULTIPLE_CONS_THREADS 5
@@ -13,13 +14,13 @@
 
 #define FAIL_ERROR { fprintf(stderr, "FAIL\n"); exit(1); }
 
-circle_buffer buffer;
+circle_buffer *buffer;
 
 void* insert_num(void* num_insert_p) {
     int num_insert = *(int*)num_insert_p;
 
     while (num_insert--) {
-        push(&buffer, &num_insert);
+        push(buffer, &num_insert);
         //printf("Inserting: %d", num_insert);
     }
     pthread_exit(NULL);
@@ -30,7 +31,7 @@ void* remove_num_check_order(void* num_remove_p) {
     int takeout;
 
     while (num_remove--) {
-        pop(&buffer, &takeout);
+        pop(buffer, &takeout);
         if (takeout != num_remove) {
             printf("%d, %d\n", num_remove, takeout);
             FAIL_ERROR;
@@ -45,7 +46,7 @@ void* remove_num(void* num_remove_p) {
     int takeout;
 
     while (num_remove--) {
-        pop(&buffer, &takeout);
+        pop(buffer, &takeout);
         //fprintf(stderr, "Removing: %d\n", takeout);
     }
     pthread_exit(NULL);
@@ -183,12 +184,320 @@ void test_mpmc() {
     printf("MPMC done!\n");
 }
 
+#define BATCH 16
+
+volatile long batch_sum;
+
+void* insert_batches(void* num_insert_p) {
+    int num_insert = *(int*)num_insert_p;
+    int batch[BATCH];
+
+    while (num_insert > 0) {
+        for (int i = 0; i < BATCH; i++) {
+            batch[i] = --num_insert;
+        }
+        push_n(buffer, batch, BATCH);
+    }
+    pthread_exit(NULL);
+}
+
+void* remove_batches(void* num_remove_p) {
+    int num_remove = *(int*)num_remove_p;
+    int batch[BATCH];
+    size_t got;
+
+    while (num_remove > 0) {
+        pop_n(buffer, batch, num_remove < BATCH ? num_remove : BATCH, &got);
+        for (size_t i = 0; i < got; i++) {
+            __sync_fetch_and_add(&batch_sum, batch[i]);
+        }
+        num_remove -= got;
+    }
+    pthread_exit(NULL);
+}
+
+void test_batch() {
+    int in[BATCH * 3], out[BATCH * 3];
+
+    // Straddle the end of the ring so both copies get used.
+    while ((buffer->tail_idx & buffer->mask) != 100) {
+        push(buffer, in);
+        pop(buffer, out);
+    }
+    for (int i = 0; i < BATCH * 3; i++) {
+        in[i] = i;
+    }
+    if (try_push_n(buffer, in, BATCH * 3) != BATCH * 3 ||
+        try_pop_n(buffer, out, BATCH * 3) != BATCH * 3) {
+        FAIL_ERROR;
+    }
+    for (int i = 0; i < BATCH * 3; i++) {
+        if (out[i] != i) {
+            FAIL_ERROR;
+        }
+    }
+    if (try_pop_n(buffer, out, BATCH) != 0) {
+        FAIL_ERROR;
+    }
+    printf("Batch done!\n");
+}
+
+/* Negative elements continue a run. */
+static int linked(const void *elem) {
+    return *(const int*)elem < 0;
+}
+
+void test_run() {
+    int in[] = { -1, -2, 3, 4, -5, -6 }, out[8];
+
+    // A run only comes out whole, and not before its end is in.
+    if (try_push_n(buffer, in, 6) != 6 ||
+        try_pop_run(buffer, out, 8, linked) != 3 ||
+        out[0] != -1 || out[2] != 3 ||
+        try_pop_run(buffer, out, 8, linked) != 1 || out[0] != 4 ||
+        try_pop_run(buffer, out, 8, linked) != 0) {
+        FAIL_ERROR;
+    }
+    // Cut short at max, the rest is a run of its own.
+    if (try_pop_run(buffer, out, 1, linked) != 1 || out[0] != -5) {
+        FAIL_ERROR;
+    }
+    in[0] = 7;
+    if (!try_push(buffer, in) ||
+        try_pop_run(buffer, out, 8, linked) != 2 ||
+        out[0] != -6 || out[1] != 7 || !is_empty(buffer)) {
+        FAIL_ERROR;
+    }
+    printf("Run done!\n");
+}
+
+void test_push_run() {
+    int in[] = { -1, -2, 3, 4, -5 }, out[8], one = 1;
+    size_t room;
+
+    // Only finished runs go in, the open one at the end stays out.
+    if (try_push_run(buffer, in, 5, linked) != 4 ||
+        try_pop_run(buffer, out, 8, linked) != 3 ||
+        try_pop_run(buffer, out, 8, linked) != 1 || !is_empty(buffer)) {
+        FAIL_ERROR;
+    }
+    // A run that doesn't fit whole isn't pushed at all.
+    room = buffer->size - 2;
+    for (size_t i = 0; i < room; i++) {
+        if (!try_push(buffer, &one)) {
+            FAIL_ERROR;
+        }
+    }
+    if (try_push_run(buffer, in, 3, linked) != 0 || count_entries(buffer) != room) {
+        FAIL_ERROR;
+    }
+    while (try_pop_n(buffer, out, 8))
+        ;
+    if (try_push_run(buffer, in, 3, linked) != 3 ||
+        try_pop_run(buffer, out, 8, linked) != 3 || out[2] != 3) {
+        FAIL_ERROR;
+    }
+    printf("Push run done!\n");
+}
+
+void test_peek_slot() {
+    int in[] = { 1, 2 }, out[2];
+    size_t head = buffer->head_idx;
+    int *slot;
+
+    // Only what is queued can be looked at, in place.
+    if (peek_slot(buffer, head) || try_push_n(buffer, in, 2) != 2 ||
+        !(slot = peek_slot(buffer, head + 1)) || *slot != 2 ||
+        peek_slot(buffer, head + 2)) {
+        FAIL_ERROR;
+    }
+    *slot = 3;
+    if (try_pop_n(buffer, out, 2) != 2 || out[1] != 3 || peek_slot(buffer, head)) {
+        FAIL_ERROR;
+    }
+    printf("Peek slot done!\n");
+}
+
+void test_advance_head() {
+    int in[] = { 1, 2, 3 }, out;
+    size_t head = buffer->head_idx;
+    int *slot;
+
+    // Reading in place and then handing the slots back is as good as popping.
+    if (try_push_n(buffer, in, 3) != 3 || !(slot = peek_slot(buffer, head)) ||
+        *slot != 1 || advance_head(buffer, 2) != 2 || buffer->head_idx != head + 2 ||
+        count_entries(buffer) != 1) {
+        FAIL_ERROR;
+    }
+    // Only what was published can be skipped.
+    if (advance_head(buffer, 2) != 1 || advance_head(buffer, 1) != 0 ||
+        try_pop(buffer, &out)) {
+        FAIL_ERROR;
+    }
+    // The slots are free for the next lap.
+    for (int i = 0; i < QUEUE_SIZE; i++) {
+        if (!try_push(buffer, &i)) {
+            FAIL_ERROR;
+        }
+    }
+    for (int i = 0; i < QUEUE_SIZE; i++) {
+        if (!try_pop(buffer, &out) || out != i) {
+            FAIL_ERROR;
+        }
+    }
+    printf("Advance head done!\n");
+}
+
+void test_mpmc_batch() {
+    pthread_t prod_thread[MULTIPLE_PROD_THREADS];
+    pthread_t cons_thread[MULTIPLE_CONS_THREADS];
+
+    int err;
+    int num_insert = (INSERTS/MULTIPLE_PROD_THREADS/BATCH)*BATCH;
+    int num_remove = num_insert*MULTIPLE_PROD_THREADS/MULTIPLE_CONS_THREADS;
+    long expected = (long)MULTIPLE_PROD_THREADS*num_insert*(num_insert - 1)/2;
+
+    batch_sum = 0;
+    for (int i = 0; i < MULTIPLE_PROD_THREADS; i++) {
+        err = pthread_create(&prod_thread[i], NULL, insert_batches, &num_insert);
+        if (err) {
+            FAIL_ERROR;
+        }
+    }
+    for (int i = 0; i < MULTIPLE_CONS_THREADS; i++) {
+        err = pthread_create(&cons_thread[i], NULL, remove_batches, &num_remove);
+        if (err) {
+            FAIL_ERROR;
+        }
+    }
+
+    for (int i = 0; i < MULTIPLE_PROD_THREADS; i++) {
+        err = pthread_join(prod_thread[i], NULL);
+        if (err) {
+            FAIL_ERROR;
+        }
+    }
+    for (int i = 0; i < MULTIPLE_CONS_THREADS; i++) {
+        err = pthread_join(cons_thread[i], NULL);
+        if (err) {
+            FAIL_ERROR;
+        }
+    }
+
+    if (batch_sum != expected || !is_empty(buffer)) {
+        FAIL_ERROR;
+    }
+    printf("MPMC batch done!\n");
+}
+
+
+void test_full_empty() {
+    int val;
+
+    // QUEUE_SIZE is rounded up to the next power of two.
+    if (buffer->size != 128) {
+        FAIL_ERROR;
+    }
+    // Go around the ring a few times to cover the sequence number laps.
+    for (int lap = 0; lap < 3; lap++) {
+        for (int i = 0; i < 128; i++) {
+            if (!try_push(buffer, &i)) {
+                FAIL_ERROR;
+            }
+        }
+        if (try_push(buffer, &val) || !is_full(buffer) || count_entries(buffer) != 128) {
+            FAIL_ERROR;
+        }
+        for (int i = 0; i < 128; i++) {
+            if (!try_pop(buffer, &val) || val != i) {
+                FAIL_ERROR;
+            }
+        }
+        if (try_pop(buffer, &val) || !is_empty(buffer)) {
+            FAIL_ERROR;
+        }
+    }
+    printf("Full/empty done!\n");
+}
+
+void test_aligned_layout() {
+    struct { long a, b, c; } in = { 0 }, out;
+    circle_buffer *aligned;
+
+    aligned = malloc(circle_buffer_size_layout(sizeof(in), QUEUE_SIZE, CB_LAYOUT_ALIGNED));
+    if (!aligned) {
+        FAIL_ERROR;
+    }
+    init_buffer_layout(aligned, sizeof(in), QUEUE_SIZE, CB_LAYOUT_ALIGNED);
+    if (aligned->stride != 32 || aligned->data_offset % CB_CACHELINE) {
+        FAIL_ERROR;
+    }
+    for (int lap = 0; lap < 3; lap++) {
+        for (in.b = 0; in.b < 128; in.b++) {
+            push(aligned, &in);
+        }
+        if (!is_full(aligned)) {
+            FAIL_ERROR;
+        }
+        for (long i = 0; i < 128; i++) {
+            pop(aligned, &out);
+            if (out.b != i) {
+                FAIL_ERROR;
+            }
+        }
+        if (!is_empty(aligned)) {
+            FAIL_ERROR;
+        }
+    }
+    free(aligned);
+    printf("Aligned layout done!\n");
+}
+
+void* pop_one(void* dest_p) {
+    pop(buffer, dest_p);
+    pthread_exit(NULL);
+}
+
+void test_sleep_wake() {
+    pthread_t cons_thread;
+    int in = 42, out = 0;
+
+    if (pthread_create(&cons_thread, NULL, pop_one, &out)) {
+        FAIL_ERROR;
+    }
+    // Long past the spinning, the consumer should be asleep by now. It
+    // wakes up every CB_SLEEP_MS to look again, so give it a few tries.
+    for (int tries = 0; buffer->not_empty.waiters != 1; tries++) {
+        if (tries == 100) {
+            FAIL_ERROR;
+        }
+        usleep(1000);
+    }
+    push(buffer, &in);
+    if (pthread_join(cons_thread, NULL) || out != in || buffer->not_empty.waiters) {
+        FAIL_ERROR;
+    }
+    printf("Sleep/wake done!\n");
+}
 
 int main () {
-    init_buffer(&buffer, sizeof(int), QUEUE_SIZE);
+    buffer = malloc(circle_buffer_size(sizeof(int), QUEUE_SIZE));
+    if (!buffer) {
+        FAIL_ERROR;
+    }
+    init_buffer(buffer, sizeof(int), QUEUE_SIZE);
+    test_full_empty();
+    test_aligned_layout();
+    test_sleep_wake();
     test_spsc();
     test_mpsc();
     test_spmc();
     test_mpmc();
+    test_batch();
+    test_run();
+    test_push_run();
+    test_peek_slot();
+    test_advance_head();
+    test_mpmc_batch();
     return 0;
 }